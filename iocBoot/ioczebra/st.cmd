@@ -19,8 +19,18 @@ zebra_registerRecordDeviceDriver(pdbbase)
 
 drvAsynIPPortConfigure("ty_zebra","moxa:PORT")
 
-#zebraConfig(Port, SerialPort, MaxPosCompPoints)
-zebraConfig("ZEBRA", "ty_zebra", 100000)
+## Or use a simulated zebra instead of the real one
+#zebraSimConfig(Port, FramesPerSecond, CommandLatencyMs, OfferBinaryFrames)
+#zebraSimConfig("ty_zebra", 100000, 1, 1)
+#zebraSimFaults(Port, JunkFraction, TruncatedFraction, StallEverySecs, StallForSecs)
+#zebraSimFaults("ty_zebra", 0.001, 0.001, 10, 0.5)
+
+#zebraConfig(Port, SerialPort, MaxPosCompPoints, RingDepth, SharedWorkers)
+zebraConfig("ZEBRA", "ty_zebra", 100000, 10000, 0)
+
+## When built with ADCORE, set ND_ENABLE and areaDetector plugins can take
+## the captures from port ZEBRA_ND, e.g.
+#NDFileHDF5Configure("ZEBRA_HDF", 20, 0, "ZEBRA_ND", 0)
 
 
 ## Load record instances
@@ -4,33 +4,65 @@
 #include <string.h>
 #include <math.h>
 #include <epicsTime.h>
+#include <epicsMath.h>
 #include <epicsThread.h>
 #include <epicsMutex.h>
 #include <epicsString.h>
 #include <epicsStdio.h>
 #include <epicsMutex.h>
+#include <epicsEvent.h>
 #include <epicsExport.h>
 #include <iocsh.h>
 #include "asynOctetSyncIO.h"
 #include "asynCommonSyncIO.h"
 #include "asynPortDriver.h"
 #include "epicsThread.h"
-#include "epicsMessageQueue.h"
 #include "ini.h"
 #include "zebraRegs.h"
-
-/* This is the number of messages on our queue */
+#include "zebraRing.h"
+#include "zebraSched.h"
+#include "zebraDecode.h"
+#include "zebraFile.h"
+#include "zebraStats.h"
+#include "zebraDerived.h"
+#ifdef ZEBRA_NDARRAY
+#include "zebraNDArray.h"
+#endif
+
+/* This is the default number of frames on each of our rings */
 #define NQUEUE 10000
 
 /* The size of our transmit and receive buffers,
  * max filename length and string param buffers */
 #define NBUFF 255
 
+/* The size of a slot on the receive rings. The longest frame zebra sends is
+ * a position compare interrupt of P + 11 * 8 hex digits */
+#define NFRAME 128
+
+/* The size of the buffer the read thread splits into frames when zebra is
+ * sending binary frames, which have no terminator for asyn to split on */
+#define NRAW 4096
+
+/* The values of FRAMING */
+#define FRAMING_ASCII 0
+#define FRAMING_BINARY 1
+
 /* The timeout waiting for a response from zebra */
 #define TIMEOUT 1.0
 
-/* The min time between sending 2 read commands without waiting for the reponse */
-#define DELAYMULTIREAD 0.01
+/* The max number of read commands that can be sent without waiting for the response */
+#define NWINDOW 16
+
+/* The max number of register writes that can be buffered in a transaction */
+#define NTRANS 64
+
+/* The number of failed batches of register writes remembered for anyone
+ * waiting on them */
+#define NWRITEFAILS 16
+
+/* The poll loop tick, the slow registers are spread over the ticks in a sweep */
+#define POLLTICK 0.25
 
 /* The last FASTREGS should be polled quickly */
 #define FASTREGS 6
@@ -41,6 +73,40 @@
 /* This is the number of filtered waveforms to allow */
 #define NFILT 4
 
+/* In streaming mode the capture store is split into this many chunks, each
+ * of which is published as a separate waveform update when it fills up */
+#define NCHUNKS 10
+
+/* This is the max number of points sent in one update of the delta waveforms,
+ * it should match NELM of the delta waveform records */
+#define NDELTA 10000
+
+/* This is the number of derived channels, see zebraDerived.h */
+#define NDERIVED 4
+
+/* This is the max number of buckets in the preview waveforms, each bucket has
+ * the min, max, first and last of a run of points so live plots can be drawn
+ * from a few KB however long the acquisition is */
+#define NPREVIEW 10000
+
+/* This is the max number of interrupts serviced in one go before the lock is
+ * released to let anyone else waiting for it in */
+#define NBATCH 1000
+
+/* This is the max number of points the file writer copies out of the capture
+ * store and writes as one block */
+#define NFILEPTS 10000
+
+/* This is the number of register configurations that can be held in memory */
+#define NBANKS 4
+
+/* These are the lock hold time histograms, one for each place that holds
+ * the driver lock for any length of time */
+#define HOLD_INTERRUPT 0
+#define HOLD_POLL 1
+#define HOLD_WRITE 2
+#define NHOLD 3
+
 /* We want to block while waiting on an asyn port forever.
  * Unfortunately putting 0 or a large number causes it to
  * poll and take up lots of CPU. This number seems to work
@@ -66,17 +132,40 @@
 
 static const char *driverName = "zebra";
 
+/* One step of the decode plan, this turns the next field of a position
+ * compare frame into a value for channel a */
+struct decodeStep {
+	int a;          // channel (PC_CAPn - 1) this field belongs to
+	int isSigned;   // encoders are signed, system bus and dividers are not
+	double scale;   // Mn_SCALE
+	double off;     // Mn_OFF
+	double *col;    // capture column to store it in, NULL if not allocated
+};
+
 class zebra: public asynPortDriver {
 public:
-	zebra(const char *portName, const char* serialPortName, int maxPts);
+	zebra(const char *portName, const char* serialPortName, int maxPts, int queueDepth, int shared);
 
 	/* These are the methods that we override from asynPortDriver */
 	virtual asynStatus writeInt32(asynUser *pasynUser, epicsInt32 value);
+	virtual asynStatus writeFloat64(asynUser *pasynUser, epicsFloat64 value);
+	virtual asynStatus readFloat64Array(asynUser *pasynUser, epicsFloat64 *value, size_t nElements, size_t *nIn);
+	virtual asynStatus readInt8Array(asynUser *pasynUser, epicsInt8 *value, size_t nElements, size_t *nIn);
 
 	/** These should be private, but get called from C, so must be public */
 	void pollTask();
 	void readTask();
 	void interruptTask();
+	void ioTask();
+	double pollOnce();
+	double interruptJob();
+	void wakeInterruptJob();
+	void fileTask();
+	double fileOnce();
+	void writeTask();
+	void writeOnce(int signalled);
+	void configTask();
+	double configOnce();
 	int configLine(const char* section, const char* name, const char* value);
 
 protected:
@@ -85,14 +174,47 @@ protected:
 	asynStatus receive(const char* format, int *addr, int *value);
 	asynStatus sendSetReg(const reg *r, int value);
 	asynStatus receiveSetReg(const reg *r);
-	asynStatus setReg(const reg *r, int value);
 	asynStatus sendGetReg(const reg *r);
 	asynStatus receiveGetReg(const reg *r, int *value);
-	asynStatus getReg(const reg *r, int *value);
+	asynStatus readRegs(const int *idx, int n, int window, int *values);
+	asynStatus writeRegs(const reg **regs, const int *vals, int n, int window, int *values);
+	void setRegParam(const reg *r, int value);
+	asynStatus bufferWrite(const reg *r, int value);
+	asynStatus waitWrites(int since);
 	asynStatus flashCmd(const char *cmd);
 	asynStatus configRead(const char* str);
 	asynStatus configWrite(const char* str);
-	asynStatus callbackWaveforms();
+	asynStatus configApply(const int *image);
+	asynStatus callbackWaveforms(int flush);
+	void publishWaveforms(int start, int n);
+	void publishDeltas(int firstPt, int start, int n);
+	void publishNDArray(int firstPt, int start, int n);
+	void filterColumn(int a);
+	asynStatus allocateStore(int cap);
+	void freeStore();
+	void callbackColumn(double *col, int start, int n, int param);
+	void buildPlan();
+	int storeIndex();
+	void handOffChunks();
+	int windowRange(size_t nElements, int *first);
+	void resetPreview();
+	void mergePreview();
+	void updatePreview();
+	void publishPreview();
+	void resetLiveStats();
+	void updateLiveStats();
+	void publishLiveStats();
+	void latchDerived(int cap);
+	void updateDerived();
+	void publishStats();
+	void resetStats();
+	double serviceInterrupts();
+	void negotiateFraming();
+	int splitRaw(char *buf, int len);
+	void rxInterrupt(const char *frame, int len);
+	void rxMessage(const char *msg, int len);
+	void wakeFile();
+	void wakeConfig();
 
 protected:
 	/* Parameter indices */
@@ -110,16 +232,88 @@ protected:
 	int zebraConfigWrite;        // int32 write - write config to filename
 	int zebraConfigStatus;       // int32 read - config status message
 	int zebraPCTime;             // float64array read - position compare timestamps
-#define LAST_PARAM zebraPCTime
+	int zebraStream;             // int32 write - stream data in chunks rather than stopping at maxPts
+	int zebraNumLost;            // int32 read - number of data points that had no room in the store
+	int zebraDeltaOnly;          // int32 write - only send new points during acquisition
+	int zebraDeltaStart;         // int32 read - index of first point in the delta waveforms
+	int zebraNDEnable;           // int32 write - also send new points as NDArrays on the <port>_ND port
+	int zebraPCTimeDelta;        // float64array read - position compare timestamps since last update
+	int zebraWinOffset;          // int32 write - first point of the window reads, negative counts back from the newest
+	int zebraWinCount;           // int32 write - number of points in the window reads
+	int zebraWinStart;           // int32 read - index of the first point the last window read got
+	int zebraWinNum;             // int32 read - number of points the last window read got
+	int zebraPCTimeWin;          // float64array read - position compare timestamps in the window
+	int zebraPreviewBuckets;     // int32 write - max number of buckets in the preview waveforms, used at next arm
+	int zebraPreviewNum;         // int32 read - number of buckets in the preview waveforms
+	int zebraPreviewWidth;       // int32 read - number of points in each bucket of the preview waveforms
+	int zebraPCTimePreview;      // float64array read - position compare timestamp of the first point in each bucket
+	int zebraLiveCount;          // int32 read - number of points in the live statistics
+	int zebraLiveDtMin;          // float64 read - shortest interval between points
+	int zebraLiveDtMax;          // float64 read - longest interval between points
+	int zebraLiveDtMean;         // float64 read - mean interval between points
+	int zebraLiveDtStd;          // float64 read - standard deviation of the interval between points
+	int zebraLiveRate;           // float64 read - sample rate in Hz from the last interval
+	int zebraLiveRateAvg;        // float64 read - sample rate in Hz over the acquisition
+	int zebraMaxPoints;          // int32 write - size of the capture store allocated at next arm
+	int zebraFilePath;           // charArray write - directory to write capture files to
+	int zebraFileName;           // charArray write - name of the capture file
+	int zebraFileCapture;        // int32 read/write - write the next acquisition to file, cleared when done
+	int zebraFileNumWritten;     // int32 read - number of points written to file
+	int zebraPublishRate;        // float64 write - max rate in Hz to publish values from interrupts
+	int zebraPollWindow;         // int32 write - max number of register reads in flight when polling
+	int zebraPollPeriod;         // float64 write - time in s to poll every register once
+	int zebraVerifyPeriod;       // float64 write - time in s between rereading static registers
+	int zebraTransBegin;         // int32 write - buffer register writes until TRANS_COMMIT
+	int zebraTransCommit;        // int32 write - send buffered register writes and read them back
+	int zebraWriteWait;          // int32 write - register writes wait until they have been read back
+	int zebraFraming;            // int32 read - whether zebra sends capture frames as ascii or binary
+	int zebraConfigProgress;     // int32 read - percentage of the registers written by CONFIG_READ
+	int zebraConfigBank;         // int32 write - which bank CONFIG_READ/WRITE/APPLY use
+	int zebraConfigBankName;     // string read - the file the selected bank was read from or saved to
+	int zebraConfigApply;        // int32 write - write the selected bank to zebra
+	int zebraStatFrameRate;      // float64 read - frames received per second
+	int zebraStatByteRate;       // float64 read - bytes received per second
+	int zebraStatIntDepth;       // int32 read - interrupts waiting to be serviced
+	int zebraStatIntHwm;         // int32 read - most interrupts that have been waiting
+	int zebraStatMsgDepth;       // int32 read - replies waiting to be read
+	int zebraStatMsgHwm;         // int32 read - most replies that have been waiting
+	int zebraStatDropped;        // int32 read - frames dropped because a ring was full
+	int zebraStatMalformed;      // int32 read - frames that could not be understood
+	int zebraStatOverruns;       // int32 read - poll ticks that took longer than their period
+	int zebraStatLinkLost;       // int32 read - binary frames zebra sent that never arrived
+	int zebraStatSweepTime;      // float64 read - how long the last complete poll sweep took
+	int zebraStatReadRtt;        // int32array read - round trip histogram of register reads
+	int zebraStatWriteRtt;       // int32array read - round trip histogram of register writes
+	int zebraStatHold[NHOLD];    // int32array read - lock hold histograms for interrupts, polling and writeInt32
+	int zebraStatReset;          // int32 write - zero the counters and histograms
+#define LAST_PARAM zebraStatReset
 	int zebraScale[NARRAYS];     // float64 write - Scale (MRES) of motors
 	int zebraOff[NARRAYS];       // float64 write - offset of motors
 	int zebraCapArrays[NARRAYS]; // float64array read - position compare capture array
 	int zebraCapLast[NARRAYS];   // float64 read - last captured value
+	int zebraCapDelta[NARRAYS];  // float64array read - position compare captures since last update
+	int zebraCapWin[NARRAYS];    // float64array read - position compare captures in the window
+	int zebraCapPMin[NARRAYS];   // float64array read - min capture in each bucket of the preview
+	int zebraCapPMax[NARRAYS];   // float64array read - max capture in each bucket of the preview
+	int zebraCapPFirst[NARRAYS]; // float64array read - first capture in each bucket of the preview
+	int zebraCapPLast[NARRAYS];  // float64array read - last capture in each bucket of the preview
+	int zebraCapMin[NARRAYS];    // float64 read - min capture of the acquisition so far
+	int zebraCapMax[NARRAYS];    // float64 read - max capture of the acquisition so far
+	int zebraCapMean[NARRAYS];   // float64 read - mean capture of the acquisition so far
+	int zebraCapStd[NARRAYS];    // float64 read - standard deviation of the captures of the acquisition so far
 	int zebraFiltArrays[NFILT];  // int8array read - position compare sys bus filtered
 	int zebraFiltSel[NFILT];     // int32 read/write - which index of system bus to select for zebraFiltArrays
 	int zebraFiltSelStr[NFILT];  // string read - the name of the entry in the system bus
+	int zebraFiltWin[NFILT];     // int8array read - position compare sys bus filtered in the window
+	int zebraDerOp[NDERIVED];    // int32 write - operation of each derived channel, used at next arm
+	int zebraDerA[NDERIVED];     // int32 write - PC_CAPn (n - 1) a derived channel is worked out from
+	int zebraDerB[NDERIVED];     // int32 write - PC_CAPn (n - 1) a sum is worked out from as well
+	int zebraDerWrap[NDERIVED];  // float64 write - value a counter wraps at for derived differences and rates
+	int zebraDerScale[NDERIVED]; // float64 write - scale derived channels are multiplied by
+	int zebraDerArrays[NDERIVED];// float64array read - derived channel array
+	int zebraDerDelta[NDERIVED]; // float64array read - derived channel since last update
 	int zebraReg[NREGS * 2];     // int32 read/write - all zebra params in reg_lookup
-#define NUM_PARAMS (&LAST_PARAM - &FIRST_PARAM + 1) + NARRAYS*4 + NFILT*3 + NREGS*2
+#define NUM_PARAMS (&LAST_PARAM - &FIRST_PARAM + 1) + NARRAYS*14 + NFILT*4 + NDERIVED*7 + NREGS*2
 
 private:
 	asynUser *pasynUser;
@@ -129,10 +323,54 @@ private:
 	void *octetPvt;
 	asynDrvUser *pasynDrvUser;
 	void *drvUserPvt;
-	epicsMessageQueueId msgQId, intQId;
-	int maxPts, currPt, configPhase, doneInit;
+	zebraRing *msgRing, *intRing;
+	int maxPts, currPt, doneInit, staticStale, configImage[NREGS];
+	int streaming, chunkPts, storePts, pubPt, lostPts, deltaPt;
+	int fileCapture, fileCap, filePt, fileDone, acqNum;
+	int fileAcq, fileNcols, fileWritten, fileJob;
+	FILE *fileFp;
+	const char *fileColNames[NARRAYS + 1];
+	char fileFullName[NBUFF * 2 + 2], fileCapNames[NARRAYS][NBUFF];
+	epicsEventId fileEvent;
+#ifdef ZEBRA_NDARRAY
+	zebraNDArrays *ndArrays;
+#endif
+	double *fileBuf;
+	int previewBuckets, previewN, previewWidth, previewPt, previewDirty;
+	double *previewBuf, *previewTime, *previewMin[NARRAYS], *previewMax[NARRAYS];
+	double *previewFirst[NARRAYS], *previewLast[NARRAYS];
+	int livePt, liveDirty, tspreParam;
+	double liveLastT;
+	zebraRunStats liveStats[NARRAYS], liveDt;
+	int derOp[NDERIVED], derA[NDERIVED], derB[NDERIVED], derPt;
+	double derWrap[NDERIVED], derScale[NDERIVED], *derArrays[NDERIVED];
+	zebraDeriveState derState[NDERIVED];
+	int capParam, planValid, planCap, planN, planBus[2];
+	int transOpen, transN, transVals[NTRANS];
+	const reg *transRegs[NTRANS];
+	int connected, writeSeq, writeDoneSeq, readbackSeq, transSeq;
+	int writeTakenSeq, writeFails[NWRITEFAILS][2], writeNfail, writeHeld;
+	int framing, framingStale, rawFraming, rawWanted, binSeq;
+	epicsEventId writeEvent, writeDoneEvent;
+	epicsMutexId commsLock;
+	char bankNames[NBANKS][NBUFF];
+	int bank, bankSave[NBANKS], bankRegs[NBANKS][NREGS];
+	epicsEventId configEvent;
+	int configJob;
+	int capLoParam, capHiParam, pollAll[NREGS], pollVol[NREGS], pollFast[FASTREGS], pollNall, pollNvol;
+	int *pollSweep, pollNsweep, pollPos, pollIteration, intJob, intDecoded, intPending;
+	epicsTimeStamp lastVerify, lastPublish;
+	int statFrames, statBytes, statDropped, statMalformed, statOverruns, statIntHwm, statMsgHwm, statLinkLost;
+	int statLastFrames, statLastBytes, statReadRtt[ZEBRA_HIST_BINS], statWriteRtt[ZEBRA_HIST_BINS];
+	int statHold[NHOLD][ZEBRA_HIST_BINS];
+	double unlockedTime;
+	epicsTimeStamp statLastTime, sweepStart;
+	decodeStep plan[NARRAYS];
+	double capLast[NARRAYS];
+	int filtSel[NFILT];
 	char *filtArrays[NFILT];
-	double *PCTime, tOffset, *capArrays[NARRAYS];
+	epicsUInt32 *sysBus[2];
+	double *PCTime, tOffset, lastTime, *capArrays[NARRAYS];
 };
 
 /* C function to call poll task from epicsThreadCreate */
@@ -153,6 +391,56 @@ static void interruptTaskC(void *userPvt) {
 	pPvt->interruptTask();
 }
 
+/* C function to call file writer task from epicsThreadCreate */
+static void fileTaskC(void *userPvt) {
+	zebra *pPvt = (zebra *) userPvt;
+	pPvt->fileTask();
+}
+
+/* C function to call write task from epicsThreadCreate */
+static void writeTaskC(void *userPvt) {
+	zebra *pPvt = (zebra *) userPvt;
+	pPvt->writeTask();
+}
+
+/* C function to call I/O task from epicsThreadCreate */
+static void ioTaskC(void *userPvt) {
+	zebra *pPvt = (zebra *) userPvt;
+	pPvt->ioTask();
+}
+
+/* C functions to run interrupt, file and config jobs on the shared scheduler */
+static double fileJobC(void *userPvt) {
+	zebra *pPvt = (zebra *) userPvt;
+	return pPvt->fileOnce();
+}
+
+static double configJobC(void *userPvt) {
+	zebra *pPvt = (zebra *) userPvt;
+	return pPvt->configOnce();
+}
+
+static double interruptJobC(void *userPvt) {
+	zebra *pPvt = (zebra *) userPvt;
+	return pPvt->interruptJob();
+}
+
+static void wakeInterruptJobC(void *userPvt) {
+	zebra *pPvt = (zebra *) userPvt;
+	pPvt->wakeInterruptJob();
+}
+
+/* The scheduler shared by all zebras created with shared workers, made by the
+ * first of them with the number of workers it asked for */
+static zebraScheduler *sharedSched = NULL;
+static int sharedWorkers = 0;
+
+/* C function to call config saving task from epicsThreadCreate */
+static void configTaskC(void *userPvt) {
+	zebra *pPvt = (zebra *) userPvt;
+	pPvt->configTask();
+}
+
 /* C function to call new message from  task from epicsThreadCreate */
 static int configLineC(void* userPvt, const char* section, const char* name,
 		const char* value) {
@@ -161,11 +449,11 @@ static int configLineC(void* userPvt, const char* section, const char* name,
 }
 
 /* Constructor */
-zebra::zebra(const char* portName, const char* serialPortName, int maxPts) :
+zebra::zebra(const char* portName, const char* serialPortName, int maxPts, int queueDepth, int shared) :
 		asynPortDriver(portName, 1 /*maxAddr*/, NUM_PARAMS,
-				asynInt8ArrayMask | asynFloat64ArrayMask | asynInt32Mask
+				asynInt8ArrayMask | asynInt32ArrayMask | asynFloat64ArrayMask | asynInt32Mask
 						| asynFloat64Mask | asynOctetMask | asynDrvUserMask,
-				asynInt8ArrayMask | asynFloat64ArrayMask | asynInt32Mask
+				asynInt8ArrayMask | asynInt32ArrayMask | asynFloat64ArrayMask | asynInt32Mask
 						| asynFloat64Mask | asynOctetMask, ASYN_CANBLOCK, /*ASYN_CANBLOCK=1, ASYN_MULTIDEVICE=0 */
 				1, /*autoConnect*/0, /*default priority */
 				0 /*default stack size*/) {
@@ -176,13 +464,81 @@ zebra::zebra(const char* portName, const char* serialPortName, int maxPts) :
 	char str[NBUFF];
 	const reg *r;
 
-	/* For position compare results */
-	this->maxPts = maxPts;
+	/* For position compare results, the store is allocated on arm */
+	this->maxPts = 0;
 	this->currPt = 0;
+	this->tOffset = 0.0;
+	this->lastTime = 0.0;
+
+	/* For streaming, the store is a whole number of chunks */
+	this->streaming = 0;
+	this->chunkPts = 1;
+	this->storePts = 0;
+	this->pubPt = 0;
+	this->lostPts = 0;
+	this->deltaPt = 0;
+
+	/* The file writer copies points out of the store into its own buffer */
+	this->fileCapture = 0;
+	this->fileCap = 0;
+	this->filePt = 0;
+	this->fileDone = 0;
+	this->acqNum = 0;
+	this->fileAcq = -1;
+	this->fileNcols = 0;
+	this->fileWritten = 0;
+	this->fileFp = NULL;
+	this->fileFullName[0] = '\0';
+	for (int a = 0; a < NARRAYS; a++) {
+		epicsSnprintf(this->fileCapNames[a], NBUFF, "PC_CAP%d", a + 1);
+	}
+	this->fileEvent = epicsEventMustCreate(epicsEventEmpty);
+	this->fileBuf = (double *) calloc(NFILEPTS * (NARRAYS + 1), sizeof(double));
+
+	/* The decode plan is built when the first frame arrives */
+	this->planValid = 0;
+	this->planCap = 0;
+	this->planN = 0;
 
 	/* So we know when we have a complete set of params that we are allowed to write to file */
 	this->doneInit = 0;
 
+	/* The static registers must be read once before we trust their params */
+	this->staticStale = 1;
+
+	/* No register writes queued */
+	this->transOpen = 0;
+	this->transN = 0;
+	this->writeSeq = 0;
+	this->writeDoneSeq = 0;
+	this->readbackSeq = 0;
+	this->writeTakenSeq = 0;
+	this->writeNfail = 0;
+	this->writeHeld = 0;
+	this->transSeq = 0;
+	this->writeEvent = epicsEventMustCreate(epicsEventEmpty);
+	this->writeDoneEvent = epicsEventMustCreate(epicsEventEmpty);
+
+	/* Only one thread at a time can talk to zebra, this is held instead of
+	 * the driver lock while waiting for it to reply */
+	this->commsLock = epicsMutexMustCreate();
+	this->connected = 0;
+
+	/* Frames are ascii until we have asked zebra if it can do binary */
+	this->framing = FRAMING_ASCII;
+	this->framingStale = 1;
+	this->rawFraming = 0;
+	this->rawWanted = 0;
+	this->binSeq = -1;
+
+	/* All config banks empty */
+	this->bank = 0;
+	for (int b = 0; b < NBANKS; b++) {
+		this->bankNames[b][0] = '\0';
+		this->bankSave[b] = 0;
+	}
+	this->configEvent = epicsEventMustCreate(epicsEventEmpty);
+
 	/* Connection status */
 	createParam("ISCONNECTED", asynParamInt32, &zebraIsConnected);
 	setIntegerParam(zebraIsConnected, 0);
@@ -226,8 +582,133 @@ zebra::zebra(const char* portName, const char* serialPortName, int maxPts) :
 
 	/* position compare time array */
 	createParam("PC_TIME", asynParamFloat64Array, &zebraPCTime);
-	this->PCTime = (double *) calloc(maxPts, sizeof(double));
-
+	this->PCTime = NULL;
+
+	/* size of the capture store, can be changed between acquisitions */
+	createParam("MAX_POINTS", asynParamInt32, &zebraMaxPoints);
+	setIntegerParam(zebraMaxPoints, maxPts);
+
+	/* parameters for writing captured data to file */
+	createParam("FILE_PATH", asynParamOctet, &zebraFilePath);
+	createParam("FILE_NAME", asynParamOctet, &zebraFileName);
+	createParam("FILE_CAPTURE", asynParamInt32, &zebraFileCapture);
+	setIntegerParam(zebraFileCapture, 0);
+	createParam("FILE_NUM_WRITTEN", asynParamInt32, &zebraFileNumWritten);
+	setIntegerParam(zebraFileNumWritten, 0);
+
+	/* how often to publish the values that come from interrupts */
+	createParam("PUBLISH_RATE", asynParamFloat64, &zebraPublishRate);
+	setDoubleParam(zebraPublishRate, 10.0);
+
+	/* how hard to poll the registers */
+	createParam("POLL_WINDOW", asynParamInt32, &zebraPollWindow);
+	setIntegerParam(zebraPollWindow, 8);
+	createParam("POLL_PERIOD", asynParamFloat64, &zebraPollPeriod);
+	setDoubleParam(zebraPollPeriod, 1.0);
+	createParam("VERIFY_PERIOD", asynParamFloat64, &zebraVerifyPeriod);
+	setDoubleParam(zebraVerifyPeriod, 60.0);
+
+	/* register write transactions */
+	createParam("TRANS_BEGIN", asynParamInt32, &zebraTransBegin);
+	createParam("TRANS_COMMIT", asynParamInt32, &zebraTransCommit);
+
+	/* register writes are queued and puts return at once, unless WRITE_WAIT
+	 * is set when they wait until the write has been read back */
+	createParam("WRITE_WAIT", asynParamInt32, &zebraWriteWait);
+	setIntegerParam(zebraWriteWait, 0);
+
+	/* how zebra sends capture frames, decided when we connect */
+	createParam("FRAMING", asynParamInt32, &zebraFraming);
+	setIntegerParam(zebraFraming, FRAMING_ASCII);
+
+	/* how far through loading a config file we are */
+	createParam("CONFIG_PROGRESS", asynParamInt32, &zebraConfigProgress);
+	setIntegerParam(zebraConfigProgress, 0);
+
+	/* register configurations held in memory */
+	createParam("CONFIG_BANK", asynParamInt32, &zebraConfigBank);
+	setIntegerParam(zebraConfigBank, 0);
+	createParam("CONFIG_BANK_NAME", asynParamOctet, &zebraConfigBankName);
+	setStringParam(zebraConfigBankName, "");
+	createParam("CONFIG_APPLY", asynParamInt32, &zebraConfigApply);
+
+	/* counters and histograms of how the driver is coping */
+	createParam("STAT_FRAME_RATE", asynParamFloat64, &zebraStatFrameRate);
+	createParam("STAT_BYTE_RATE", asynParamFloat64, &zebraStatByteRate);
+	createParam("STAT_INT_DEPTH", asynParamInt32, &zebraStatIntDepth);
+	createParam("STAT_INT_HWM", asynParamInt32, &zebraStatIntHwm);
+	createParam("STAT_MSG_DEPTH", asynParamInt32, &zebraStatMsgDepth);
+	createParam("STAT_MSG_HWM", asynParamInt32, &zebraStatMsgHwm);
+	createParam("STAT_DROPPED", asynParamInt32, &zebraStatDropped);
+	createParam("STAT_MALFORMED", asynParamInt32, &zebraStatMalformed);
+	createParam("STAT_OVERRUNS", asynParamInt32, &zebraStatOverruns);
+	createParam("STAT_LINK_LOST", asynParamInt32, &zebraStatLinkLost);
+	createParam("STAT_SWEEP_TIME", asynParamFloat64, &zebraStatSweepTime);
+	createParam("STAT_READ_RTT", asynParamInt32Array, &zebraStatReadRtt);
+	createParam("STAT_WRITE_RTT", asynParamInt32Array, &zebraStatWriteRtt);
+	createParam("STAT_HOLD_INTERRUPT", asynParamInt32Array, &zebraStatHold[HOLD_INTERRUPT]);
+	createParam("STAT_HOLD_POLL", asynParamInt32Array, &zebraStatHold[HOLD_POLL]);
+	createParam("STAT_HOLD_WRITE", asynParamInt32Array, &zebraStatHold[HOLD_WRITE]);
+	createParam("STAT_RESET", asynParamInt32, &zebraStatReset);
+	setDoubleParam(zebraStatFrameRate, 0);
+	setDoubleParam(zebraStatByteRate, 0);
+	setDoubleParam(zebraStatSweepTime, 0);
+
+	/* streaming mode, and the number of points we couldn't store */
+	createParam("PC_STREAM", asynParamInt32, &zebraStream);
+	setIntegerParam(zebraStream, 0);
+	createParam("PC_NUM_LOST", asynParamInt32, &zebraNumLost);
+	setIntegerParam(zebraNumLost, 0);
+
+	/* delta waveforms that only have the points that arrived since the last update */
+	createParam("PC_DELTA_ONLY", asynParamInt32, &zebraDeltaOnly);
+	setIntegerParam(zebraDeltaOnly, 0);
+	createParam("PC_DELTA_START", asynParamInt32, &zebraDeltaStart);
+	setIntegerParam(zebraDeltaStart, 0);
+
+	/* NDArray output for areaDetector plugins, which connect to <port>_ND */
+	createParam("ND_ENABLE", asynParamInt32, &zebraNDEnable);
+	setIntegerParam(zebraNDEnable, 0);
+#ifdef ZEBRA_NDARRAY
+	epicsSnprintf(str, NBUFF, "%s_ND", portName);
+	this->ndArrays = new zebraNDArrays(str, 0);
+#endif
+	createParam("PC_TIME_DELTA", asynParamFloat64Array, &zebraPCTimeDelta);
+
+	/* window on the capture store, read straight from it rather than called back */
+	createParam("PC_WIN_OFFSET", asynParamInt32, &zebraWinOffset);
+	setIntegerParam(zebraWinOffset, 0);
+	createParam("PC_WIN_COUNT", asynParamInt32, &zebraWinCount);
+	setIntegerParam(zebraWinCount, 1000);
+	createParam("PC_WIN_START", asynParamInt32, &zebraWinStart);
+	setIntegerParam(zebraWinStart, 0);
+	createParam("PC_WIN_NUM", asynParamInt32, &zebraWinNum);
+	setIntegerParam(zebraWinNum, 0);
+	createParam("PC_TIME_WIN", asynParamFloat64Array, &zebraPCTimeWin);
+
+	/* decimated preview of the acquisition for live plots */
+	createParam("PC_PREVIEW_BUCKETS", asynParamInt32, &zebraPreviewBuckets);
+	setIntegerParam(zebraPreviewBuckets, 500);
+	createParam("PC_PREVIEW_NUM", asynParamInt32, &zebraPreviewNum);
+	setIntegerParam(zebraPreviewNum, 0);
+	createParam("PC_PREVIEW_WIDTH", asynParamInt32, &zebraPreviewWidth);
+	setIntegerParam(zebraPreviewWidth, 1);
+	createParam("PC_TIME_PREVIEW", asynParamFloat64Array, &zebraPCTimePreview);
+	this->previewBuf = NULL;
+	this->previewBuckets = 0;
+	this->previewN = 0;
+	this->previewWidth = 1;
+	this->previewPt = 0;
+	this->previewDirty = 0;
+
+	/* live statistics of the acquisition, kept up to date as points arrive */
+	createParam("PC_LIVE_COUNT", asynParamInt32, &zebraLiveCount);
+	createParam("PC_LIVE_DT_MIN", asynParamFloat64, &zebraLiveDtMin);
+	createParam("PC_LIVE_DT_MAX", asynParamFloat64, &zebraLiveDtMax);
+	createParam("PC_LIVE_DT_MEAN", asynParamFloat64, &zebraLiveDtMean);
+	createParam("PC_LIVE_DT_STD", asynParamFloat64, &zebraLiveDtStd);
+	createParam("PC_LIVE_RATE", asynParamFloat64, &zebraLiveRate);
+	createParam("PC_LIVE_RATE_AVG", asynParamFloat64, &zebraLiveRateAvg);
 	/* position compare array scale (motor resolution) */
 	for (int a = 0; a < NARRAYS; a++) {
 		epicsSnprintf(str, NBUFF, "M%d_SCALE", a + 1);
@@ -246,7 +727,7 @@ zebra::zebra(const char* portName, const char* serialPortName, int maxPts) :
 	for (int a = 0; a < NARRAYS; a++) {
 		epicsSnprintf(str, NBUFF, "PC_CAP%d", a + 1);
 		createParam(str, asynParamFloat64Array, &zebraCapArrays[a]);
-		this->capArrays[a] = (double *) calloc(maxPts, sizeof(double));
+		this->capArrays[a] = NULL;
 	}
 
 	/* create the last captured interrupt values */
@@ -255,19 +736,60 @@ zebra::zebra(const char* portName, const char* serialPortName, int maxPts) :
 		createParam(str, asynParamFloat64, &zebraCapLast[a]);
 	}
 
+	/* create the position compare delta arrays */
+	for (int a = 0; a < NARRAYS; a++) {
+		epicsSnprintf(str, NBUFF, "PC_CAP%d_DELTA", a + 1);
+		createParam(str, asynParamFloat64Array, &zebraCapDelta[a]);
+	}
+
+	/* create the position compare window arrays */
+	for (int a = 0; a < NARRAYS; a++) {
+		epicsSnprintf(str, NBUFF, "PC_CAP%d_WIN", a + 1);
+		createParam(str, asynParamFloat64Array, &zebraCapWin[a]);
+	}
+
+	/* create the position compare preview arrays */
+	for (int a = 0; a < NARRAYS; a++) {
+		epicsSnprintf(str, NBUFF, "PC_CAP%d_PMIN", a + 1);
+		createParam(str, asynParamFloat64Array, &zebraCapPMin[a]);
+		epicsSnprintf(str, NBUFF, "PC_CAP%d_PMAX", a + 1);
+		createParam(str, asynParamFloat64Array, &zebraCapPMax[a]);
+		epicsSnprintf(str, NBUFF, "PC_CAP%d_PFIRST", a + 1);
+		createParam(str, asynParamFloat64Array, &zebraCapPFirst[a]);
+		epicsSnprintf(str, NBUFF, "PC_CAP%d_PLAST", a + 1);
+		createParam(str, asynParamFloat64Array, &zebraCapPLast[a]);
+	}
+
+	/* create the position compare live statistics */
+	for (int a = 0; a < NARRAYS; a++) {
+		epicsSnprintf(str, NBUFF, "PC_CAP%d_MIN", a + 1);
+		createParam(str, asynParamFloat64, &zebraCapMin[a]);
+		epicsSnprintf(str, NBUFF, "PC_CAP%d_MAX", a + 1);
+		createParam(str, asynParamFloat64, &zebraCapMax[a]);
+		epicsSnprintf(str, NBUFF, "PC_CAP%d_MEAN", a + 1);
+		createParam(str, asynParamFloat64, &zebraCapMean[a]);
+		epicsSnprintf(str, NBUFF, "PC_CAP%d_STD", a + 1);
+		createParam(str, asynParamFloat64, &zebraCapStd[a]);
+	}
+
 	/* create filter arrays */
 	for (int a = 0; a < NFILT; a++) {
 		epicsSnprintf(str, NBUFF, "PC_FILT%d", a + 1);
 		createParam(str, asynParamInt8Array, &zebraFiltArrays[a]);
-		this->filtArrays[a] = (char *) calloc(maxPts, sizeof(char));
+		this->filtArrays[a] = NULL;
 	}
 
+	/* the raw system bus captures, these are what the filter arrays are made from */
+	this->sysBus[0] = NULL;
+	this->sysBus[1] = NULL;
+
 	/* create values that we can use to filter one element on the system bus with */
 	/* NOTE: separate for loop so we get values for params we can do arithmetic with */
 	for (int a = 0; a < NFILT; a++) {
 		epicsSnprintf(str, NBUFF, "PC_FILTSEL%d", a + 1);
 		createParam(str, asynParamInt32, &zebraFiltSel[a]);
 		setIntegerParam(zebraFiltSel[a], 0);
+		this->filtSel[a] = 0;
 	}
 
 	/* create lookups of string values of these string selects */
@@ -280,6 +802,45 @@ zebra::zebra(const char* portName, const char* serialPortName, int maxPts) :
 		setStringParam(zebraFiltSelStr[a], bus_lookup[0]);
 	}
 
+	/* create filter window arrays */
+	for (int a = 0; a < NFILT; a++) {
+		epicsSnprintf(str, NBUFF, "PC_FILT%d_WIN", a + 1);
+		createParam(str, asynParamInt8Array, &zebraFiltWin[a]);
+	}
+
+	/* create the derived channels, which are worked out as points arrive */
+	/* NOTE: separate for loops so we get values for params we can do arithmetic with */
+	for (int d = 0; d < NDERIVED; d++) {
+		epicsSnprintf(str, NBUFF, "PC_DER%d_OP", d + 1);
+		createParam(str, asynParamInt32, &zebraDerOp[d]);
+		setIntegerParam(zebraDerOp[d], ZEBRA_DER_OFF);
+		this->derOp[d] = ZEBRA_DER_OFF;
+		this->derArrays[d] = NULL;
+	}
+	for (int d = 0; d < NDERIVED; d++) {
+		epicsSnprintf(str, NBUFF, "PC_DER%d_A", d + 1);
+		createParam(str, asynParamInt32, &zebraDerA[d]);
+		setIntegerParam(zebraDerA[d], 0);
+	}
+	for (int d = 0; d < NDERIVED; d++) {
+		epicsSnprintf(str, NBUFF, "PC_DER%d_B", d + 1);
+		createParam(str, asynParamInt32, &zebraDerB[d]);
+		setIntegerParam(zebraDerB[d], 0);
+	}
+	for (int d = 0; d < NDERIVED; d++) {
+		epicsSnprintf(str, NBUFF, "PC_DER%d_WRAP", d + 1);
+		createParam(str, asynParamFloat64, &zebraDerWrap[d]);
+		setDoubleParam(zebraDerWrap[d], 0.0);
+		epicsSnprintf(str, NBUFF, "PC_DER%d_SCALE", d + 1);
+		createParam(str, asynParamFloat64, &zebraDerScale[d]);
+		setDoubleParam(zebraDerScale[d], 1.0);
+		epicsSnprintf(str, NBUFF, "PC_DER%d", d + 1);
+		createParam(str, asynParamFloat64Array, &zebraDerArrays[d]);
+		epicsSnprintf(str, NBUFF, "PC_DER%d_DELTA", d + 1);
+		createParam(str, asynParamFloat64Array, &zebraDerDelta[d]);
+	}
+	this->derPt = 0;
+
 	/* create parameters for registers */
 	for (unsigned int i = 0; i < NREGS; i++) {
 		r = &(reg_lookup[i]);
@@ -291,6 +852,10 @@ zebra::zebra(const char* portName, const char* serialPortName, int maxPts) :
 		assert(r == PARAM2REG(zebraReg[i]));
 		assert(REG2PARAM(r) == zebraReg[i]);
 	}
+	findParam("PC_BIT_CAP", &this->capParam);
+	findParam("PC_TSPRE", &this->tspreParam);
+	this->resetLiveStats();
+	this->publishLiveStats();
 
 	/* create parameters for register string values, these are lookups
 	 of the string values of mux registers from the system bus */
@@ -303,14 +868,57 @@ zebra::zebra(const char* portName, const char* serialPortName, int maxPts) :
 		assert(REG2PARAMSTR(r) == zebraReg[i+NREGS]);
 	}
 
-	/* Create a message queue to hold completed messages and interrupts */
-	this->msgQId = epicsMessageQueueCreate(NQUEUE, sizeof(char*));
-	this->intQId = epicsMessageQueueCreate(NQUEUE, sizeof(char*));
-	if (this->msgQId == NULL || this->intQId == NULL) {
-		asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
-				"%s:%s: epicsMessageQueueCreate failure\n", driverName, functionName);
-		return;
+	/* Create rings to hold completed messages and interrupts */
+	if (queueDepth <= 0) queueDepth = NQUEUE;
+	this->msgRing = new zebraRing(queueDepth, NFRAME);
+	this->intRing = new zebraRing(queueDepth, NFRAME);
+
+	/* The slow registers are everything but commands and the FASTREGS. The
+	 * volatile ones are polled every sweep, the static ones only when they
+	 * need reverifying */
+	this->pollNall = 0;
+	this->pollNvol = 0;
+	for (unsigned int i = 0; i < NREGS - FASTREGS; i++) {
+		switch (regClassOf(&(reg_lookup[i]))) {
+		case regVolatile:
+			this->pollVol[this->pollNvol++] = i;
+			this->pollAll[this->pollNall++] = i;
+			break;
+		case regStatic:
+			this->pollAll[this->pollNall++] = i;
+			break;
+		default:
+			break;
+		}
 	}
+	for (int i = 0; i < FASTREGS; i++) {
+		this->pollFast[i] = NREGS - FASTREGS + i;
+	}
+	this->pollSweep = this->pollAll;
+	this->pollNsweep = 0;
+	this->pollPos = 0;
+	this->pollIteration = 0;
+	epicsTimeGetCurrent(&this->lastVerify);
+	findParam("PC_NUM_CAPLO", &this->capLoParam);
+	findParam("PC_NUM_CAPHI", &this->capHiParam);
+
+	/* Nothing counted yet */
+	this->statFrames = 0;
+	this->statBytes = 0;
+	this->statLastFrames = 0;
+	this->statLastBytes = 0;
+	this->unlockedTime = 0;
+	epicsTimeGetCurrent(&this->statLastTime);
+	this->sweepStart = this->statLastTime;
+	this->resetStats();
+
+	/* Nothing decoded or waiting to be published */
+	this->intDecoded = 0;
+	this->intPending = 0;
+	this->intJob = -1;
+	this->fileJob = -1;
+	this->configJob = -1;
+	epicsTimeGetCurrent(&this->lastPublish);
 
 	/* Connect to the device port */
 	/* Copied from asynOctecSyncIO->connect */
@@ -343,6 +951,40 @@ zebra::zebra(const char* portName, const char* serialPortName, int maxPts) :
 	pasynOctet->setInputEos(octetPvt, pasynUser, "\n", 1);
 	pasynOctet->setOutputEos(octetPvt, pasynUser, "\n", 1);
 
+	/* In shared mode the interrupt servicing, file writing and config saving
+	 * are jobs on the shared workers instead of having threads of their own.
+	 * Reading from zebra, polling and register writes all block on the serial
+	 * link, so they are not shared: each zebra keeps its read thread, and
+	 * polling and writes share an I/O thread of its own. So N zebras take
+	 * 2N threads plus the shared workers, rather than 6N */
+	if (shared > 0) {
+		if (sharedSched == NULL) {
+			sharedSched = new zebraScheduler(shared);
+			sharedWorkers = shared;
+		} else if (shared != sharedWorkers) {
+			asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+					"%s:%s: Asked for %d shared workers, but the first zebra made %d, using those\n",
+					driverName, functionName, shared, sharedWorkers);
+		}
+		if ((this->intJob = sharedSched->add(interruptJobC, this, 0.0)) < 0
+				|| (this->fileJob = sharedSched->add(fileJobC, this, 1.0)) < 0
+				|| (this->configJob = sharedSched->add(configJobC, this, 0.0)) < 0) {
+			asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+					"%s:%s: Too many jobs for the shared workers\n", driverName, functionName);
+			return;
+		}
+		this->intRing->setNotify(wakeInterruptJobC, this);
+
+		/* Create the thread that polls and writes to the device  */
+		if (epicsThreadCreate("ZebraIOTask", epicsThreadPriorityMedium,
+				epicsThreadGetStackSize(epicsThreadStackMedium),
+				(EPICSTHREADFUNC) ioTaskC, this) == NULL) {
+			asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+					"%s:%s: epicsThreadCreate failure for I/O task\n", driverName, functionName);
+			return;
+		}
+	}
+
 	/* Create the thread that reads from the device  */
 	if (epicsThreadCreate("ZebraReadTask", epicsThreadPriorityMedium,
 			epicsThreadGetStackSize(epicsThreadStackMedium),
@@ -353,7 +995,7 @@ zebra::zebra(const char* portName, const char* serialPortName, int maxPts) :
 	}
 
 	/* Create the thread that polls the device  */
-	if (epicsThreadCreate("ZebraPollTask", epicsThreadPriorityMedium,
+	if (shared <= 0 && epicsThreadCreate("ZebraPollTask", epicsThreadPriorityMedium,
 			epicsThreadGetStackSize(epicsThreadStackMedium),
 			(EPICSTHREADFUNC) pollTaskC, this) == NULL) {
 		asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
@@ -362,300 +1004,934 @@ zebra::zebra(const char* portName, const char* serialPortName, int maxPts) :
 	}
 
 	/* Create the thread that handles interrupts from the device  */
-	if (epicsThreadCreate("ZebraInterruptTask", epicsThreadPriorityMedium,
+	if (shared <= 0 && epicsThreadCreate("ZebraInterruptTask", epicsThreadPriorityMedium,
 			epicsThreadGetStackSize(epicsThreadStackMedium),
 			(EPICSTHREADFUNC) interruptTaskC, this) == NULL) {
 		asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
 				"%s:%s: epicsThreadCreate failure for interrupt service task\n", driverName, functionName);
 		return;
 	}
+
+	/* Create the thread that sends register writes to the device  */
+	if (shared <= 0 && epicsThreadCreate("ZebraWriteTask", epicsThreadPriorityMedium,
+			epicsThreadGetStackSize(epicsThreadStackMedium),
+			(EPICSTHREADFUNC) writeTaskC, this) == NULL) {
+		asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+				"%s:%s: epicsThreadCreate failure for write task\n", driverName, functionName);
+		return;
+	}
+
+	/* Create the thread that writes captured data to file  */
+	if (shared <= 0 && epicsThreadCreate("ZebraFileTask", epicsThreadPriorityLow,
+			epicsThreadGetStackSize(epicsThreadStackMedium),
+			(EPICSTHREADFUNC) fileTaskC, this) == NULL) {
+		asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+				"%s:%s: epicsThreadCreate failure for file writer task\n", driverName, functionName);
+		return;
+	}
+
+	/* Create the thread that saves config banks to file  */
+	if (shared <= 0 && epicsThreadCreate("ZebraConfigTask", epicsThreadPriorityLow,
+			epicsThreadGetStackSize(epicsThreadStackMedium),
+			(EPICSTHREADFUNC) configTaskC, this) == NULL) {
+		asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+				"%s:%s: epicsThreadCreate failure for config task\n", driverName, functionName);
+		return;
+	}
 }
 
 /* This is the function that will be run for the read thread */
 void zebra::readTask() {
 	const char *functionName = "readTask";
-	char *rxBuffer;
+	char *rxBuffer, junkBuffer[NFRAME], rawBuffer[NRAW];
 	size_t nBytesIn;
-	int eomReason;
-	epicsMessageQueueId q;
+	int eomReason, depth, raw, rawLen = 0, carried;
 	asynStatus status = asynSuccess;
 	asynUser *pasynUserRead = pasynManager->duplicateAsynUser(pasynUser, 0, 0);
 
 	while (true) {
 		pasynUserRead->timeout = LONGWAIT;
-		/* Malloc some data to put the reply from zebra. This is freed if there is an
-		 * error, otherwise it is put on a queue, and the receiving thread should free it
+		/* Only change how we read between reads, so nothing gets read half
+		 * as lines and half raw */
+		raw = epicsAtomicGetIntT(&this->rawWanted);
+		if (raw != this->rawFraming) {
+			pasynOctet->setInputEos(octetPvt, pasynUserRead, raw ? "" : "\n", raw ? 0 : 1);
+			this->rawFraming = raw;
+		}
+		if (this->rawFraming) {
+			/* Binary frames can have a \n anywhere in them, so asyn gives us
+			 * whatever has arrived and we split it up ourselves, keeping any
+			 * partial frame at the end for next time */
+			status = pasynOctet->read(octetPvt, pasynUserRead, rawBuffer + rawLen,
+					NRAW - rawLen, &nBytesIn, &eomReason);
+			if (status) {
+				epicsThreadSleep(TIMEOUT);
+			} else {
+				epicsAtomicAddIntT(&this->statBytes, (int) nBytesIn);
+				rawLen = this->splitRaw(rawBuffer, rawLen + (int) nBytesIn);
+			}
+			continue;
+		}
+		/* Anything left over from reading raw is the start of the next line,
+		 * unless it is a binary frame that will never be finished now */
+		if (rawLen > 0 && ((unsigned char) rawBuffer[0] == ZEBRA_BINARY_MARK || rawLen >= NFRAME - 1)) {
+			asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+					"%s:%s: Bad message '%.*s'\n", driverName, functionName, rawLen, rawBuffer);
+			epicsAtomicIncrIntT(&this->statMalformed);
+			rawLen = 0;
+		}
+		/* Read straight into the next free interrupt slot as interrupts are the
+		 * high rate traffic. If the ring is full we still have to read the line
+		 * to keep in step, so use a scratch buffer and drop it later
 		 */
-		rxBuffer = (char *) malloc(NBUFF);
-		status = pasynOctet->read(octetPvt, pasynUserRead, rxBuffer, NBUFF - 1,
+		rxBuffer = this->intRing->writeSlot();
+		if (rxBuffer == NULL) {
+			rxBuffer = junkBuffer;
+		}
+		memcpy(rxBuffer, rawBuffer, rawLen);
+		status = pasynOctet->read(octetPvt, pasynUserRead, rxBuffer + rawLen, NFRAME - 1 - rawLen,
 				&nBytesIn, &eomReason);
+		carried = 0;
+		if (status == asynSuccess || nBytesIn > 0) {
+			carried = rawLen;
+			nBytesIn += rawLen;
+			rawLen = 0;
+		}
 		if (status) {
 			//printf("Port not connected\n");
-			free(rxBuffer);
 			epicsThreadSleep(TIMEOUT);
 		} else if (eomReason & ASYN_EOM_EOS) {
 			// Replace the terminator with a null so we can use it as a string
 			rxBuffer[nBytesIn] = '\0';
+			epicsAtomicIncrIntT(&this->statFrames);
+			epicsAtomicAddIntT(&this->statBytes, (int) nBytesIn - carried + 1);
 			if (rxBuffer[0] == 'P') {
-				// This is an interrupt, send it to the interrupt queue
+				// This is an interrupt, it is already in place on the interrupt ring
 				asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
 						"%s:%s: Interrupt: '%s'\n", driverName, functionName, rxBuffer);
-				q = this->intQId;
+				if (rxBuffer == junkBuffer) {
+					asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+							"%s:%s: Interrupt ring full, dropped message\n", driverName, functionName);
+					epicsAtomicIncrIntT(&this->statDropped);
+				} else {
+					this->intRing->commitSlot((int) nBytesIn);
+					depth = this->intRing->pending();
+					if (depth > epicsAtomicGetIntT(&this->statIntHwm)) {
+						epicsAtomicSetIntT(&this->statIntHwm, depth);
+					}
+				}
 			} else {
-				// This a zebra response to a command, send it to the message queue
-				asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
-						"%s:%s: Message: '%s'\n", driverName, functionName, rxBuffer);
-				q = this->msgQId;
-			}
-			if (epicsMessageQueueTrySend(q, &rxBuffer, sizeof(&rxBuffer))
-					!= 0) {
-				asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
-						"%s:%s: Message queue full, dropped message\n", driverName, functionName);
-				free(rxBuffer);
+				if (strcmp(rxBuffer, "BOK") == 0) {
+					// Zebra sends binary frames from now on, and they can have a
+					// \n anywhere, so split them ourselves from the next read
+					epicsAtomicSetIntT(&this->rawWanted, 1);
+				}
+				// This a zebra response to a command, copy it to the message ring
+				this->rxMessage(rxBuffer, (int) nBytesIn);
 			}
 		} else {
 			asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
 					"%s:%s: Bad message '%.*s'\n", driverName, functionName, (int)nBytesIn, rxBuffer);
-			free(rxBuffer);
+			epicsAtomicIncrIntT(&this->statMalformed);
+		}
+	}
+}
+
+/* Split len bytes of raw input from zebra in buf into binary frames and
+ * lines, and put them on the rings. Returns how many bytes are left over
+ * at the start of buf, which are the beginning of a frame or line that
+ * hasn't all arrived yet
+ * called by the read thread */
+int zebra::splitRaw(char *buf, int len) {
+	const char *functionName = "splitRaw";
+	int pos = 0, n, end, lost;
+	unsigned int seq;
+	while (pos < len) {
+		if ((unsigned char) buf[pos] == ZEBRA_BINARY_MARK) {
+			// A binary frame, the second byte says how long it is
+			if (len - pos < 2) break;
+			n = ZEBRA_BINARY_HEADER + ((unsigned char) buf[pos + 1]) * 4;
+			if (n >= NFRAME) {
+				// Can't be a frame, skip the mark and look for the next one
+				asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+						"%s:%s: Bad binary frame length %d\n", driverName, functionName, n);
+				epicsAtomicIncrIntT(&this->statMalformed);
+				pos++;
+				continue;
+			}
+			if (len - pos < n) break;
+			// Any gap in the sequence numbers is frames lost on the way here
+			seq = zebraBinarySeq(buf + pos);
+			lost = zebraBinaryLost(this->binSeq, seq);
+			if (lost > 0) {
+				asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+						"%s:%s: Lost %d binary frames before sequence number %u\n", driverName, functionName, lost, seq);
+				epicsAtomicAddIntT(&this->statLinkLost, lost);
+			}
+			this->binSeq = seq;
+			epicsAtomicIncrIntT(&this->statFrames);
+			this->rxInterrupt(buf + pos, n);
+			pos += n;
+			continue;
+		}
+		// A line, which zebra terminates with \n
+		for (end = pos; end < len && buf[end] != '\n'; end++);
+		if (end == len) {
+			if (len - pos < NFRAME) break;
+			// Too long to be anything zebra sends, throw it away
+			asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+					"%s:%s: Bad message '%.*s'\n", driverName, functionName, len - pos, buf + pos);
+			epicsAtomicIncrIntT(&this->statMalformed);
+			pos = len;
+			break;
+		}
+		n = end - pos;
+		if (n > 0 && buf[end - 1] == '\r') n--;
+		if (n > 0 && n < NFRAME) {
+			buf[pos + n] = '\0';
+			epicsAtomicIncrIntT(&this->statFrames);
+			if (buf[pos] == 'P') {
+				if (strcmp(buf + pos, "PR") == 0) {
+					// Sequence numbers can start anywhere for a new acquisition
+					this->binSeq = -1;
+				}
+				this->rxInterrupt(buf + pos, n);
+			} else {
+				this->rxMessage(buf + pos, n);
+			}
+		} else if (n > 0) {
+			asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+					"%s:%s: Bad message '%.*s'\n", driverName, functionName, n, buf + pos);
+			epicsAtomicIncrIntT(&this->statMalformed);
+		}
+		pos = end + 1;
+	}
+	// Move the leftovers to the start
+	memmove(buf, buf + pos, len - pos);
+	return len - pos;
+}
+
+/* Copy an interrupt of len bytes onto the interrupt ring
+ * called by the read thread */
+void zebra::rxInterrupt(const char *frame, int len) {
+	const char *functionName = "rxInterrupt";
+	int depth;
+	char *slot = this->intRing->writeSlot();
+	if (slot == NULL) {
+		asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+				"%s:%s: Interrupt ring full, dropped message\n", driverName, functionName);
+		epicsAtomicIncrIntT(&this->statDropped);
+		return;
+	}
+	memcpy(slot, frame, len);
+	slot[len] = '\0';
+	this->intRing->commitSlot(len);
+	depth = this->intRing->pending();
+	if (depth > epicsAtomicGetIntT(&this->statIntHwm)) {
+		epicsAtomicSetIntT(&this->statIntHwm, depth);
+	}
+}
+
+/* Copy a zebra response to a command of len bytes onto the message ring
+ * called by the read thread */
+void zebra::rxMessage(const char *msg, int len) {
+	const char *functionName = "rxMessage";
+	int depth;
+	char *slot;
+	asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+			"%s:%s: Message: '%.*s'\n", driverName, functionName, len, msg);
+	slot = this->msgRing->writeSlot();
+	if (slot == NULL) {
+		asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+				"%s:%s: Message ring full, dropped message\n", driverName, functionName);
+		epicsAtomicIncrIntT(&this->statDropped);
+		return;
+	}
+	memcpy(slot, msg, len);
+	slot[len] = '\0';
+	this->msgRing->commitSlot(len);
+	depth = this->msgRing->pending();
+	if (depth > epicsAtomicGetIntT(&this->statMsgHwm)) {
+		epicsAtomicSetIntT(&this->statMsgHwm, depth);
+	}
+}
+
+/* Read SYS_VER to see if zebra can send binary frames, and if it can ask it
+ * to. Otherwise, or if it won't, stick to ascii. The read thread changes to
+ * splitting the input itself when it sees BOK, as that is the last line
+ * before the binary frames start
+ * called with the comms lock taken */
+void zebra::negotiateFraming() {
+	const char *functionName = "negotiateFraming";
+	int idx = -1, version, binary = 0;
+	asynStatus status;
+	for (unsigned int i = 0; i < NREGS; i++) {
+		if (strcmp(reg_lookup[i].str, "SYS_VER") == 0) idx = i;
+	}
+	if (idx < 0 || this->readRegs(&idx, 1, 1, &version) != asynSuccess || version < 0) {
+		// Not talking to zebra, try again next time
+		return;
+	}
+	epicsAtomicSetIntT(&this->framingStale, 0);
+	if (version & ZEBRA_VER_BINARY) {
+		status = this->flashCmd("B");
+		binary = (status == asynSuccess);
+		if (status == asynTimeout) {
+			// We don't know if zebra got it, so it may be sending binary
+			// frames without us having seen BOK. Splitting the input
+			// ourselves copes with both, so do that and ask again next time
+			asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+					"%s:%s: No reply to B, resyncing\n", driverName, functionName);
+			epicsAtomicSetIntT(&this->rawWanted, 1);
+			epicsAtomicSetIntT(&this->framingStale, 1);
+			return;
+		} else if (!binary) {
+			// It replied with something else, so it is still sending ascii
+			asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+					"%s:%s: SYS_VER 0x%04X offers binary frames but zebra refused them\n", driverName, functionName, version);
 		}
 	}
+	if (!binary) {
+		epicsAtomicSetIntT(&this->rawWanted, 0);
+	}
+	this->framing = binary ? FRAMING_BINARY : FRAMING_ASCII;
 }
 
 /* This is the function that will be run for the interrupt service thread */
 void zebra::interruptTask() {
-	const char *functionName = "interruptTask";
-	int cap, param, incr;
-	unsigned int time, nfound;
-	char *rxBuffer, *ptr, escapedbuff[NBUFF];
-	epicsTimeStamp start, end;
+	double wait = TIMEOUT;
 	while (true) {
-		// Get the time we started
-		epicsTimeGetCurrent(&start);
-		// Lock as we will be updating params
-		this->lock();
-		// If there are any interrupts, service them
-		while (epicsMessageQueuePending(this->intQId) > 0) {
-			epicsMessageQueueReceive(this->intQId, &rxBuffer,
-					sizeof(&rxBuffer));
-			if (strcmp(rxBuffer, "PR") == 0) {
-				// This is zebra telling us to reset our buffers
-				this->currPt = 0;
-				this->tOffset = 0.0;
-				// Set it acquiring
+		// Block until an interrupt arrives, or it is time to publish the
+		// values we have already got
+		if (this->intRing->waitSlot(wait, NULL) == NULL && !this->intPending) {
+			continue;
+		}
+		wait = this->serviceInterrupts();
+		if (wait == 0) {
+			// Still busy, give anyone waiting for the lock a chance to get it
+			epicsThreadSleep(0.0);
+		}
+	}
+}
+
+/* This is the job run on the shared workers instead of interruptTask. It
+ * returns how long until it needs to run again, but will be woken early by
+ * the read thread if an interrupt arrives */
+double zebra::interruptJob() {
+	double wait = TIMEOUT;
+	if (this->intRing->readSlot(NULL) != NULL || this->intPending) {
+		wait = this->serviceInterrupts();
+	}
+	// Go idle, unless something arrived while we were busy
+	if (wait > 0 && !this->intRing->idle()) {
+		wait = 0;
+	}
+	return wait;
+}
+
+/* Called by the read thread when an interrupt arrives for an idle interruptJob */
+void zebra::wakeInterruptJob() {
+	sharedSched->wake(this->intJob);
+}
+
+/* Tell the file writer there are points or a new acquisition for it */
+void zebra::wakeFile() {
+	if (this->fileJob >= 0) {
+		sharedSched->wake(this->fileJob);
+	} else {
+		epicsEventSignal(this->fileEvent);
+	}
+}
+
+/* Tell the config saver there is a bank to save */
+void zebra::wakeConfig() {
+	if (this->configJob >= 0) {
+		sharedSched->wake(this->configJob);
+	} else {
+		epicsEventSignal(this->configEvent);
+	}
+}
+
+/* This services a batch of interrupts, and publishes what we have got if it
+ * is time to. Returns how long until it needs to be called again to publish,
+ * or 0 if there are more interrupts waiting */
+double zebra::serviceInterrupts() {
+	const char *functionName = "serviceInterrupts";
+	int cap, len, bad, binary, w, pt, urgent, batch;
+	unsigned int words[NARRAYS + 1], bus[2];
+	double time, rate, since, wait;
+	const char *rxBuffer;
+	char escapedbuff[NBUFF];
+	epicsTimeStamp now, locked;
+	// Lock as we will be updating params
+	this->lock();
+	epicsTimeGetCurrent(&locked);
+	urgent = 0;
+	// Service a batch of interrupts, stopping early for an arm or disarm
+	// so it is published straight away
+	for (batch = 0; batch < NBATCH && !urgent
+			&& (rxBuffer = this->intRing->readSlot(&len)) != NULL; batch++) {
+		this->intPending = 1;
+		if (strcmp(rxBuffer, "PR") == 0) {
+			// This is zebra telling us to reset our buffers, size them for
+			// what we are about to capture
+			getIntegerParam(this->capParam, &cap);
+			this->latchDerived(cap);
+			this->allocateStore(cap);
+			this->resetPreview();
+			this->resetLiveStats();
+			this->currPt = 0;
+			this->derPt = 0;
+			this->tOffset = 0.0;
+			this->lastTime = 0.0;
+			this->pubPt = 0;
+			this->lostPts = 0;
+			this->deltaPt = 0;
+			setIntegerParam(zebraNumLost, 0);
+			// Only change mode between acquisitions
+			getIntegerParam(zebraStream, &this->streaming);
+			// Tell the file writer there is a new acquisition
+			this->acqNum++;
+			this->filePt = 0;
+			this->fileDone = 0;
+			this->fileCap = cap & ((1 << NARRAYS) - 1);
+			getIntegerParam(zebraFileCapture, &this->fileCapture);
+			if (this->fileCapture) {
+				setIntegerParam(zebraFileNumWritten, 0);
+				this->wakeFile();
+			}
+			// Set it acquiring
                 setIntegerParam(zebraArrayAcq, 1);								
-				// We need to trigger a waveform update so that PC_NUM_DOWN
-				// will unset the busy record set by the arm
-				// Setting NumDown to -1 will trigger a waveform update even if
-				// the last waveform sent was the same as this one
-				setIntegerParam(zebraNumDown, -1);
-				this->callbackWaveforms();
-				// reset num cap
-				findParam("PC_NUM_CAPLO", &param);
-				setIntegerParam(param, 0);
-				findParam("PC_NUM_CAPHI", &param);
-				setIntegerParam(param, 0);
-			} else if (strcmp(rxBuffer, "PX") == 0) {
-				// This is zebra saying there is no more data
-				setIntegerParam(zebraArrayAcq, 0);				
-				// Setting NumDown to -1 will trigger a waveform update even if
-				// the last waveform sent was the same as this one
-				setIntegerParam(zebraNumDown, -1);
-				this->callbackWaveforms();
+			// We need to trigger a waveform update so that PC_NUM_DOWN
+			// will unset the busy record set by the arm
+			// Setting NumDown to -1 will trigger a waveform update even if
+			// the last waveform sent was the same as this one
+			setIntegerParam(zebraNumDown, -1);
+			this->callbackWaveforms(0);
+			// reset num cap
+			setIntegerParam(this->capLoParam, 0);
+			setIntegerParam(this->capHiParam, 0);
+			urgent = 1;
+		} else if (strcmp(rxBuffer, "PX") == 0) {
+			// This is zebra saying there is no more data
+			setIntegerParam(zebraArrayAcq, 0);				
+			// Setting NumDown to -1 will trigger a waveform update even if
+			// the last waveform sent was the same as this one
+			setIntegerParam(zebraNumDown, -1);
+			// Flush out any partially filled chunk too
+			this->callbackWaveforms(1);
+			// The file writer can close the file when it has caught up
+			this->fileDone = 1;
+			if (this->fileCapture) {
+				this->wakeFile();
+			}
+			urgent = 1;
+		} else {
+			// This is a data buffer, make sure we have a plan for decoding it
+			if (!this->planValid) {
+				this->buildPlan();
+			}
+			cap = this->planCap;
+			// Check the length and decode all the fields in one go
+			binary = ((unsigned char) rxBuffer[0] == ZEBRA_BINARY_MARK);
+			if (binary) {
+				bad = zebraDecodeBinary(rxBuffer, len, cap, words);
 			} else {
-				// This is a data buffer
-				ptr = rxBuffer;
-				// First get time
-				nfound = sscanf(rxBuffer, "P%08X%n", &time, &incr);
-				if (nfound == 1) {
-					// put time in time units (10s, s or ms based on TS_PRE)
-					this->PCTime[this->currPt] = time * 0.0001 + this->tOffset;
-					if (this->currPt > 0
-							&& this->PCTime[this->currPt]
-									< this->PCTime[this->currPt - 1]) {
-						// we've rolled over the counter, increment the offset
-						this->tOffset += COUNTERROLLOVER;
-						this->PCTime[this->currPt] += COUNTERROLLOVER;
-					}
-					ptr += incr;
+				bad = zebraDecodeFrame(rxBuffer, len, cap, words);
+			}
+			if (bad != 0) {
+				epicsStrnEscapedFromRaw(escapedbuff, NBUFF, rxBuffer, len);
+				if (bad == ZEBRA_DECODE_BADLEN) {
+					asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+							"%s:%s: Bad interrupt length %d, expected %d for PC_BIT_CAP 0x%X in '%s'\n", driverName, functionName, len, binary ? zebraBinaryLength(cap) : zebraFrameLength(cap), cap, escapedbuff);
+				} else if (bad == 1) {
+					asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+							"%s:%s: Bad interrupt on time '%s'\n", driverName, functionName, escapedbuff);
 				} else {
+					// Work out which encoder the bad field belongs to
+					for (w = 0; w < NARRAYS; w++) {
+						if (cap >> w & 1 && --bad == 1) break;
+					}
 					asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
-							"%s:%s: Bad interrupt on time '%s', nfound:%d\n", driverName, functionName, rxBuffer, nfound);
-					free(rxBuffer);
-					continue;
+							"%s:%s: Bad interrupt on encoder %d in '%s'\n", driverName, functionName, w+1, escapedbuff);
 				}
-				// See which encoders are being captured so we can decode the interrupt
-				findParam("PC_BIT_CAP", &param);
-				getIntegerParam(param, &cap);
-				// Now step through the bytes
-				for (int a = 0; a < NARRAYS; a++) {
-					double scale, off, dvalue = 0;
-					int ivalue;
-					if (cap >> a & 1) {
-						if (sscanf(ptr, "%08X%n", &ivalue, &incr) == 1) {
-							getDoubleParam(zebraScale[a], &scale);
-							getDoubleParam(zebraOff[a], &off);
-							if (a >= 4) {
-							    // system bus and dividers are unsigned 32-bit numbers
-							    dvalue = ((unsigned int) ivalue) * scale + off;
-							} else {
-							    // encoders are signed 32-bit numbers
-    							dvalue = ivalue * scale + off;
-    						}
-							ptr += incr;
-						} else {
-							epicsStrnEscapedFromRaw(escapedbuff, NBUFF, rxBuffer,
-									strlen(rxBuffer));
-							asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
-									"%s:%s: Bad interrupt on encoder %d in '%s'\n", driverName, functionName, a+1, escapedbuff);
-							break;
-						}
-					}
-					// publish value to double param
-					setDoubleParam(zebraCapLast[a], dvalue-1);
-					setDoubleParam(zebraCapLast[a], dvalue);
-					// publish value to waveform if we have room
-					if (this->currPt < this->maxPts) {
-						this->capArrays[a][this->currPt] = dvalue;
-					}
-					// Note: don't do callParamCallbacks here, or we'll swamp asyn
+				epicsAtomicIncrIntT(&this->statMalformed);
+				this->intRing->releaseSlot();
+				continue;
+			}
+			// put time in time units (10s, s or ms based on TS_PRE)
+			time = words[0] * 0.0001 + this->tOffset;
+			if (time < this->lastTime) {
+				// we've rolled over the counter, increment the offset
+				this->tOffset += COUNTERROLLOVER;
+				time += COUNTERROLLOVER;
+			}
+			this->lastTime = time;
+			// Work out where this point goes in the store
+			pt = this->storeIndex();
+			if (pt >= 0) {
+				this->PCTime[pt] = time;
+			}
+			// Now step through the decoded fields, one plan step per field
+			for (int f = 0; f < this->planN; f++) {
+				const decodeStep *d = &this->plan[f];
+				double dvalue = (d->isSigned ? (double) (int) words[f + 1] : (double) words[f + 1])
+						* d->scale + d->off;
+				this->capLast[d->a] = dvalue;
+				// store value in waveform if we have room
+				if (pt >= 0 && d->col != NULL) {
+					d->col[pt] = dvalue;
 				}
-				// sanity check
-				if (ptr[0] != '\0') {
-					epicsStrnEscapedFromRaw(escapedbuff, NBUFF, ptr,
-							strlen(ptr));
-					asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
-							"%s:%s: Characters remaining in interrupt: '%s'\n", driverName, functionName, escapedbuff);
+			}
+			this->intDecoded++;
+			// extract the selected system bus bits for the filter arrays
+			if (pt >= 0) {
+				bus[0] = (this->planBus[0] > 0) ? words[this->planBus[0]] : 0;
+				bus[1] = (this->planBus[1] > 0) ? words[this->planBus[1]] : 0;
+				if (this->sysBus[0] != NULL) this->sysBus[0][pt] = bus[0];
+				if (this->sysBus[1] != NULL) this->sysBus[1][pt] = bus[1];
+				for (int a = 0; a < NFILT; a++) {
+					if (this->filtArrays[a] != NULL) {
+						this->filtArrays[a][pt] = (bus[this->filtSel[a] >> 5] >> (this->filtSel[a] & 31)) & 1;
+					}
 				}
-				// advance the counter if allowed
-				if (this->currPt < this->maxPts) {
-					this->currPt++;
+			}
+			// advance the counter if allowed
+			if (pt >= 0) {
+				this->currPt++;
+				// In streaming mode hand off each chunk as soon as it fills, so
+				// the rest of the batch can reuse it
+				if (this->streaming && this->currPt - this->pubPt >= this->chunkPts) {
+					this->handOffChunks();
 				}
+			} else {
+				this->lostPts++;
 			}
-			free(rxBuffer);
 		}
-		// Update any params we have got, this means that the max update rate
-		// of the waveform last values is this loop tick (10Hz).
-		callParamCallbacks();
-		this->unlock();
-		// Work out how long to sleep for so each loop iteration takes 0.1s
-		epicsTimeGetCurrent(&end);
-		double timeToSleep = 0.1 - epicsTimeDiffInSeconds(&end, &start);
-		if (timeToSleep > 0) {
-			epicsThreadSleep(timeToSleep);
-		} else {
-			// Got to sleep for a bit in case something else is waiting for the lock
-			epicsThreadSleep(0.01);
-			//printf("Not enough time to poll properly %f\n", timeToSleep);
+		this->intRing->releaseSlot();
+	}
+	// Work out the derived channels and add the new points to the preview
+	// and stats, the full chunks were handed off as they filled
+	this->updateDerived();
+	this->updatePreview();
+	this->updateLiveStats();
+	// Wake the file writer if it has anything to do, it never holds us up
+	if (this->fileCapture && this->currPt > this->filePt) {
+		this->wakeFile();
+	}
+	// Publish no faster than PUBLISH_RATE, except for arm and disarm
+	getDoubleParam(zebraPublishRate, &rate);
+	epicsTimeGetCurrent(&now);
+	since = epicsTimeDiffInSeconds(&now, &this->lastPublish);
+	if (urgent || since >= 1.0 / rate) {
+		setIntegerParam(zebraNumLost, this->lostPts);
+		// publish the last decoded values, changing them first so there is a
+		// monitor even if the value is the same as last time
+		if (this->intDecoded) {
+			for (int a = 0; a < NARRAYS; a++) {
+				setDoubleParam(zebraCapLast[a], this->capLast[a] - 1);
+				setDoubleParam(zebraCapLast[a], this->capLast[a]);
+			}
+		}
+		if (this->previewDirty) {
+			this->publishPreview();
+		}
+		if (this->liveDirty) {
+			this->publishLiveStats();
 		}
+		callParamCallbacks();
+		this->lastPublish = now;
+		this->intDecoded = 0;
+		this->intPending = 0;
+		wait = TIMEOUT;
+	} else {
+		// Come back when it is time to publish, sooner if more arrive
+		wait = 1.0 / rate - since;
 	}
+	this->unlock();
+	zebraHistAddSince(this->statHold[HOLD_INTERRUPT], &locked);
+	return (batch == NBATCH) ? 0 : wait;
 }
 
-/* This is the function that will be run for the poll thread */
-void zebra::pollTask() {
-	const char *functionName = "pollTask";
-	int value, caploparam, caphiparam, lastcap, downloading;
-	double loopTime;
-	const reg *r;
-	unsigned int sys, poll = 0, iteration = 0;
-	char *rxBuffer, escapedbuff[NBUFF];
-	epicsTimeStamp start, end;
-	asynStatus status = asynSuccess;
-	findParam("PC_NUM_CAPLO", &caploparam);
-	findParam("PC_NUM_CAPHI", &caphiparam);
-	// Wait 1 second until port is up
-	epicsThreadSleep(1.0);
+/* This is the function that will be run for the file writer thread */
+void zebra::fileTask() {
+	double wait = 1.0;
 	while (true) {
-		// alternate between the next slow reg, and all the fast regs
-		epicsTimeGetCurrent(&start);
-		this->lock();
-		// If there are any responses on the queue they must be junk
-		while (epicsMessageQueuePending(this->msgQId)) {
-			epicsMessageQueueReceive(this->msgQId, &rxBuffer,
-					sizeof(&rxBuffer));
-			epicsStrnEscapedFromRaw(escapedbuff, NBUFF, rxBuffer,
-					strlen(rxBuffer));
+		if (wait > 0) {
+			epicsEventWaitWithTimeout(this->fileEvent, wait);
+		}
+		wait = this->fileOnce();
+	}
+}
+
+/* This does one block of file writing. It copies the points out of the
+ * capture store with the lock taken, then writes them to file without it,
+ * so a slow disk can only make the store fill up, it never stalls the
+ * interrupt servicing. It returns 0 if there may be more to write, or how
+ * long to wait for more points.
+ * It is run by the file writer thread, or as a job on the shared workers */
+double zebra::fileOnce() {
+	const char *functionName = "fileOnce";
+	char path[NBUFF], name[NBUFF];
+	int first, start, n, ok;
+	double *cols[NARRAYS + 1];
+	this->lock();
+	// Close the file if capture was stopped, or zebra was re-armed
+	// before we caught up with the last acquisition
+	if (this->fileFp != NULL && (!this->fileCapture || this->fileAcq != this->acqNum)) {
+		if (this->fileAcq != this->acqNum) {
 			asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
-					"%s:%s: Junk message in buffer '%s'\n", driverName, functionName, escapedbuff);
-			status = asynError;
-			free(rxBuffer);
-		}
-		// Work out if we are currently downloading
-		getIntegerParam(zebraArrayAcq, &downloading);
-		// Check what PC_NUM_CAPLO is now so can check if it rolled over
-		getIntegerParam(caploparam, &lastcap);
-		if (downloading) {
-			// If we are downloading, then must wait for responses as FPGA is heavily loaded
-			for (sys = NREGS - FASTREGS; sys < NREGS; sys++) {
-				// Send demand to zebra
-				this->getReg(&(reg_lookup[sys]), &value);
-			}
-			// Now wait a second until we do it again
-			loopTime = 1.0;
-		} else if (iteration == 0) {
-			// First send requests for all the system
-			for (sys = NREGS - FASTREGS; sys < NREGS; sys++) {
-				// Send demand to zebra
-				this->sendGetReg(&(reg_lookup[sys]));
-				epicsThreadSleep(DELAYMULTIREAD);
-			}
-			// Now get values back
-			for (sys = NREGS - FASTREGS; sys < NREGS; sys++) {
-				// wait for a response on the message queue
-				this->receiveGetReg(&(reg_lookup[sys]), &value);
-			}
-			// Now wait 0.25 seconds until we get the regs below
-			loopTime = 0.25;
-		} else {
-			// Get the register value from zebra
-			status = this->getReg(&(reg_lookup[poll]), &value);
-			// skip one, then keep on skipping until it isn't a command
-			for (r = NULL; r == NULL || r->type == regCmd;) {
-				// Move to next register
-				if (++poll >= NREGS - FASTREGS) {
-					poll = 0;
-					// Done one complete cycle so write to file allowed.
-					this->doneInit = 1;
-				}
-				r = &(reg_lookup[poll]);
-			}
-			// Now wait 0.25 seconds until the next poll
-			loopTime = 0.25;
+					"%s:%s: Re-armed before %s was complete\n", driverName, functionName, this->fileFullName);
 		}
-		// check what NUM_CAP is now
-		getIntegerParam(caploparam, &value);
-		// If this is PC_NUM_CAPLO and it has rolled over, then trigger a PC_NUM_CAP_HI update
-		if (value < lastcap) {
-			//printf("Rollover!\n");
-			this->getReg(PARAM2REG(caphiparam), &value);
+		fclose(this->fileFp);
+		this->fileFp = NULL;
+	}
+	// Open a new file if this acquisition should be captured
+	if (this->fileFp == NULL && this->fileCapture && this->fileAcq != this->acqNum) {
+		this->fileAcq = this->acqNum;
+		getStringParam(zebraFilePath, NBUFF, path);
+		getStringParam(zebraFileName, NBUFF, name);
+		epicsSnprintf(this->fileFullName, sizeof(this->fileFullName), "%s%s%s", path,
+				(path[0] && path[strlen(path) - 1] != '/') ? "/" : "", name);
+		this->fileNcols = 0;
+		this->fileColNames[this->fileNcols++] = "PC_TIME";
+		for (int a = 0; a < NARRAYS; a++) {
+			if (this->fileCap >> a & 1) this->fileColNames[this->fileNcols++] = this->fileCapNames[a];
 		}
-
-		// Iteration 0 is all 6 FASTREGS, iterations 1-3 are the next slow polled regs
-		iteration++;
-		if (iteration > 3) iteration = 0;
-		// Update params
-		callParamCallbacks();
+		this->fileWritten = 0;
+		this->fileFp = fopen(this->fileFullName, "wb");
+		if (this->fileFp == NULL || !zebraFileWriteHeader(this->fileFp, this->fileCap, this->fileNcols, this->fileColNames)) {
+			asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+					"%s:%s: Can't write to file '%s'\n", driverName, functionName, this->fileFullName);
+			if (this->fileFp != NULL) fclose(this->fileFp);
+			this->fileFp = NULL;
+			this->fileCapture = 0;
+			setIntegerParam(zebraFileCapture, 0);
+			callParamCallbacks();
+		}
+	}
+	if (this->fileFp == NULL) {
 		this->unlock();
-		// We try to run this loop at 4Hz so that system values get done at 1Hz
-		// or at 1Hz during download time
-		epicsTimeGetCurrent(&end);
-		double timeToSleep = loopTime - epicsTimeDiffInSeconds(&end, &start);
-		if (timeToSleep > 0) {
-			epicsThreadSleep(timeToSleep);
+		return 1.0;
+	}
+	// Work out the next run of points that is contiguous in the store
+	first = this->filePt;
+	n = this->currPt - first;
+	start = first;
+	if (this->streaming) {
+		start = first % this->storePts;
+		if (n > this->storePts - start) n = this->storePts - start;
+	}
+	if (n > NFILEPTS) n = NFILEPTS;
+	if (n == 0) {
+		if (this->fileDone) {
+			// Disarmed and everything written, so we are finished
+			fclose(this->fileFp);
+			this->fileFp = NULL;
+			this->fileCapture = 0;
+			setIntegerParam(zebraFileCapture, 0);
+			callParamCallbacks();
+		}
+		this->unlock();
+		return 1.0;
+	}
+	// Copy the points out so the store can be recycled
+	cols[0] = this->PCTime;
+	for (int a = 0, c = 1; a < NARRAYS; a++) {
+		if (this->fileCap >> a & 1) cols[c++] = this->capArrays[a];
+	}
+	for (int c = 0; c < this->fileNcols; c++) {
+		if (cols[c] != NULL) {
+			memcpy(this->fileBuf + c * n, cols[c] + start, n * sizeof(double));
 		} else {
-			// Got to sleep for a bit in case something else is waiting for the lock
-			epicsThreadSleep(0.01);
-			//printf("Not enough time to poll properly %f\n", timeToSleep);
+			// Its store couldn't be allocated, so there is no data for it
+			for (int i = 0; i < n; i++) this->fileBuf[c * n + i] = epicsNAN;
 		}
 	}
+	this->filePt += n;
+	// Now write them without the lock
+	this->unlock();
+	ok = zebraFileWriteBlock(this->fileFp, first, n, this->fileNcols, this->fileBuf);
+	this->lock();
+	if (!ok) {
+		asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+				"%s:%s: Error writing to file '%s'\n", driverName, functionName, this->fileFullName);
+		fclose(this->fileFp);
+		this->fileFp = NULL;
+		if (this->fileAcq == this->acqNum) {
+			this->fileCapture = 0;
+			setIntegerParam(zebraFileCapture, 0);
+		}
+	} else if (this->fileAcq == this->acqNum) {
+		this->fileWritten += n;
+		setIntegerParam(zebraFileNumWritten, this->fileWritten);
+	}
+	callParamCallbacks();
+	this->unlock();
+	return 0;
+}
+
+/* This is the function that will be run for the poll thread */
+void zebra::pollTask() {
+	// Wait 1 second until port is up
+	epicsThreadSleep(1.0);
+	while (true) {
+		epicsThreadSleep(this->pollOnce());
+	}
+}
+
+/* This is the function that will be run for the I/O thread in shared mode.
+ * It does the work of both the write and poll threads, sending queued
+ * register writes as soon as they are signalled and a poll tick whenever
+ * one is due */
+void zebra::ioTask() {
+	epicsTimeStamp now, nextPoll;
+	double wait;
+	int signalled;
+	// Wait 1 second until port is up before polling
+	epicsTimeGetCurrent(&nextPoll);
+	epicsTimeAddSeconds(&nextPoll, 1.0);
+	while (true) {
+		epicsTimeGetCurrent(&now);
+		wait = epicsTimeDiffInSeconds(&nextPoll, &now);
+		if (wait > POLLTICK) wait = POLLTICK;
+		signalled = 0;
+		if (wait > 0) {
+			signalled = (epicsEventWaitWithTimeout(this->writeEvent, wait) == epicsEventWaitOK);
+		}
+		this->writeOnce(signalled);
+		epicsTimeGetCurrent(&now);
+		if (epicsTimeDiffInSeconds(&now, &nextPoll) >= 0) {
+			nextPoll = now;
+			epicsTimeAddSeconds(&nextPoll, this->pollOnce());
+		}
+	}
+}
+
+/* This does one poll tick, returning how long to wait until the next one.
+ * It is run by the poll thread, or the I/O thread in shared mode */
+double zebra::pollOnce() {
+	const char *functionName = "pollOnce";
+	int value, lastcap, downloading, window;
+	int todo[NREGS], values[NREGS], ntodo, seq, n;
+	double period, verify, loopTime;
+	unsigned int sys;
+	const char *rxBuffer;
+	char escapedbuff[NBUFF];
+	epicsTimeStamp start, end, locked;
+	// each tick do the next batch of slow regs, and all the fast regs once a second
+	epicsTimeGetCurrent(&start);
+	// Get what we need from the params, the reads are done without the
+	// lock so they don't hold up interrupts or writes
+	this->lock();
+	// Work out if we are currently downloading
+	getIntegerParam(zebraArrayAcq, &downloading);
+	getIntegerParam(zebraPollWindow, &window);
+	getDoubleParam(zebraPollPeriod, &period);
+	getDoubleParam(zebraVerifyPeriod, &verify);
+	// Check what PC_NUM_CAPLO is now so can check if it rolled over
+	getIntegerParam(this->capLoParam, &lastcap);
+	// So we can tell if the write thread updated anything while we read
+	seq = this->readbackSeq;
+	this->unlock();
+	// Make a list of the regs to read this tick
+	ntodo = 0;
+	if (downloading) {
+		// If we are downloading, then must wait for responses as FPGA is heavily loaded
+		window = 1;
+		for (sys = 0; sys < FASTREGS; sys++) todo[ntodo++] = this->pollFast[sys];
+		// Now wait a second until we do it again
+		loopTime = 1.0;
+	} else {
+		if (this->pollIteration == 0) {
+			// The system values are done at 1Hz
+			for (sys = 0; sys < FASTREGS; sys++) todo[ntodo++] = this->pollFast[sys];
+		}
+		// At the start of a sweep work out if the static regs need doing,
+		// they only change if we write them or on reset, restore or reconnect
+		if (this->pollPos == 0) {
+			if (epicsAtomicGetIntT(&this->staticStale) || epicsTimeDiffInSeconds(&start, &this->lastVerify) >= verify) {
+				this->pollSweep = this->pollAll;
+				this->pollNsweep = this->pollNall;
+				epicsAtomicSetIntT(&this->staticStale, 0);
+			} else {
+				this->pollSweep = this->pollVol;
+				this->pollNsweep = this->pollNvol;
+			}
+		}
+		// Do enough slow regs that we get round them all every POLL_PERIOD
+		n = (int) ceil(this->pollNsweep * POLLTICK / period);
+		if (n > this->pollNsweep - this->pollPos) n = this->pollNsweep - this->pollPos;
+		for (int i = 0; i < n; i++) todo[ntodo++] = this->pollSweep[this->pollPos + i];
+		this->pollPos += n;
+		// Now wait until the next tick
+		loopTime = POLLTICK;
+	}
+	epicsMutexMustLock(this->commsLock);
+	// If there are any responses on the queue they must be junk
+	while ((rxBuffer = this->msgRing->readSlot(NULL)) != NULL) {
+		epicsStrnEscapedFromRaw(escapedbuff, NBUFF, rxBuffer,
+				strlen(rxBuffer));
+		asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+				"%s:%s: Junk message in buffer '%s'\n", driverName, functionName, escapedbuff);
+		epicsAtomicIncrIntT(&this->statMalformed);
+		this->msgRing->releaseSlot();
+	}
+	// When we connect, find out how zebra can send capture frames
+	if (epicsAtomicGetIntT(&this->framingStale)) {
+		this->negotiateFraming();
+	}
+	this->readRegs(todo, ntodo, window, values);
+	epicsMutexUnlock(this->commsLock);
+	// Now update the params with what we read, unless some writes were
+	// read back since we started as what we have might be older than that
+	this->lock();
+	epicsTimeGetCurrent(&locked);
+	for (int i = 0; i < ntodo && seq == this->readbackSeq; i++) {
+		if (values[i] >= 0) this->setRegParam(&(reg_lookup[todo[i]]), values[i]);
+	}
+	if (!downloading && this->pollPos >= this->pollNsweep) {
+		this->pollPos = 0;
+		if (this->pollSweep == this->pollAll) {
+			// Done one complete cycle so write to file allowed.
+			this->doneInit = 1;
+			this->lastVerify = start;
+		}
+		setDoubleParam(zebraStatSweepTime, epicsTimeDiffInSeconds(&locked, &this->sweepStart));
+		this->sweepStart = locked;
+	}
+	// check what NUM_CAP is now
+	getIntegerParam(this->capLoParam, &value);
+	// If this is PC_NUM_CAPLO and it has rolled over, then trigger a PC_NUM_CAP_HI update
+	if (value < lastcap) {
+		//printf("Rollover!\n");
+		this->unlock();
+		todo[0] = (int) (PARAM2REG(this->capHiParam) - reg_lookup);
+		epicsMutexMustLock(this->commsLock);
+		this->readRegs(todo, 1, 1, values);
+		epicsMutexUnlock(this->commsLock);
+		this->lock();
+		if (values[0] >= 0) this->setRegParam(&(reg_lookup[todo[0]]), values[0]);
+	}
+
+	// The stats are done at 1Hz, even when downloading
+	if (epicsTimeDiffInSeconds(&locked, &this->statLastTime) >= 1.0) {
+		this->publishStats();
+	}
+	// Iteration 0 does the FASTREGS as well as the slow polled regs
+	this->pollIteration++;
+	if (this->pollIteration >= 1.0 / POLLTICK) this->pollIteration = 0;
+	// Update params
+	setIntegerParam(zebraIsConnected, this->connected);
+	setIntegerParam(zebraFraming, this->framing);
+	callParamCallbacks();
+	this->unlock();
+	zebraHistAddSince(this->statHold[HOLD_POLL], &locked);
+	// We try to run this loop at 4Hz so that system values get done at 1Hz
+	// or at 1Hz during download time
+	epicsTimeGetCurrent(&end);
+	double timeToSleep = loopTime - epicsTimeDiffInSeconds(&end, &start);
+	if (timeToSleep > 0) {
+		return timeToSleep;
+	}
+	// Got to sleep for a bit in case something else is waiting for the lock
+	epicsAtomicIncrIntT(&this->statOverruns);
+	return 0.01;
+}
+
+/* This is the function that will be run for the write thread */
+void zebra::writeTask() {
+	while (true) {
+		this->writeOnce(epicsEventWaitWithTimeout(this->writeEvent, POLLTICK) == epicsEventWaitOK);
+	}
+}
+
+/* This sends the register writes queued by writeInt32 without the lock, then
+ * takes the lock to update the readbacks and tell anyone waiting that they
+ * are done. signalled is set if writeEvent woke us, otherwise a low half
+ * queued on its own is held for a tick or two for its high half.
+ * It is run by the write thread, or the I/O thread in shared mode */
+void zebra::writeOnce(int signalled) {
+	const char *functionName = "writeOnce";
+	const reg *regs[NTRANS];
+	int vals[NTRANS], values[NTRANS], n, window, seq, from, start, end;
+	asynStatus status;
+	this->lock();
+	if (this->transOpen || this->transN == 0) {
+		this->writeHeld = 0;
+		this->unlock();
+		return;
+	}
+	// Give the low half of a 32-bit value a tick for its high half to come
+	if (!signalled && ++this->writeHeld < 2) {
+		this->unlock();
+		return;
+	}
+	this->writeHeld = 0;
+	// Take everything that is queued
+	n = this->transN;
+	memcpy(regs, this->transRegs, n * sizeof(const reg *));
+	memcpy(vals, this->transVals, n * sizeof(int));
+	this->transN = 0;
+	from = this->writeTakenSeq;
+	seq = this->writeTakenSeq = this->writeSeq;
+	getIntegerParam(zebraPollWindow, &window);
+	// A command acts on the registers written before it, and anything
+	// it makes zebra send (like PR for PC_ARM) is handled using their
+	// params, so write and read back those registers and update their
+	// params before sending the command
+	status = asynSuccess;
+	for (start = 0; start < n; start = end) {
+		for (end = start + 1; end < n && (regs[end]->type != regCmd || regs[end - 1]->type == regCmd); end++);
+		if (status != asynSuccess && regs[start]->type == regCmd) {
+			// Don't act on registers that didn't get there
+			asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+					"%s:%s: Not sending %s as the writes before it failed\n", driverName, functionName, regs[start]->str);
+			for (end = start; end < n && regs[end]->type == regCmd; end++) values[end] = -1;
+			continue;
+		}
+		this->unlock();
+		epicsMutexMustLock(this->commsLock);
+		if (this->writeRegs(regs + start, vals + start, end - start, window, values + start) != asynSuccess) {
+			status = asynError;
+		}
+		epicsMutexUnlock(this->commsLock);
+		this->lock();
+		for (int i = start; i < end; i++) {
+			if (strcmp(regs[i]->str, "SYS_RESET") == 0) {
+				// Every register is back to its default, so read them all again,
+				// and zebra will have gone back to ascii frames
+				epicsAtomicSetIntT(&this->staticStale, 1);
+				epicsAtomicSetIntT(&this->framingStale, 1);
+			}
+			if (values[i] >= 0) {
+				// do this so we always get an update on the RBV field, essential for clamping 32-bit fields to MRES
+				setIntegerParam(REG2PARAM(regs[i]), -1);
+				this->setRegParam(regs[i], values[i]);
+			}
+		}
+		this->readbackSeq++;
+		setIntegerParam(zebraIsConnected, this->connected);
+		callParamCallbacks();
+	}
+	if (status != asynSuccess) {
+		// Remember which writes this batch had so whoever is waiting for
+		// them gets the error, even if later batches finish first
+		int *fail = this->writeFails[this->writeNfail++ % NWRITEFAILS];
+		fail[0] = from;
+		fail[1] = seq;
+	}
+	this->writeDoneSeq = seq;
+	epicsEventSignal(this->writeDoneEvent);
+	this->unlock();
 }
 
 /* Send helper function
- * called with lock taken
+ * called with the comms lock taken
  */
 asynStatus zebra::send(char *txBuffer, int txSize) {
 	const char *functionName = "send";
 	asynStatus status = asynSuccess;
-	int connected;
 	size_t nBytesOut;
 	pasynUser->timeout = TIMEOUT;
 	status = pasynOctet->write(octetPvt, pasynUser, txBuffer, txSize,
@@ -664,9 +1940,11 @@ asynStatus zebra::send(char *txBuffer, int txSize) {
 			"%s:%s: Send: '%.*s'\n", driverName, functionName, txSize, txBuffer);
 	if (status != asynSuccess) {
 		// Can't write, port probably not connected
-		getIntegerParam(zebraIsConnected, &connected);
-		if (connected) {
-			setIntegerParam(zebraIsConnected, 0);
+		if (this->connected) {
+			this->connected = 0;
+			// We don't know what happened while we weren't talking
+			epicsAtomicSetIntT(&this->staticStale, 1);
+			epicsAtomicSetIntT(&this->framingStale, 1);
 			asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
 					"%s:%s: Can't write to zebra: '%.*s'\n", driverName, functionName, txSize, txBuffer);
 		}
@@ -674,19 +1952,20 @@ asynStatus zebra::send(char *txBuffer, int txSize) {
 	return status;
 }
 
-/* receive helper function, checks response matches format with optional addr and value args
- * called with lock taken
+/* receive helper function, checks response matches format with optional addr and value args.
+ * If zebra rejected the command with E1R or E1W then addr is set to the address it
+ * rejected and asynError is returned
+ * called with the comms lock taken
  */
 asynStatus zebra::receive(const char* format, int *addr, int *value) {
 	const char *functionName = "receive";
 	asynStatus status = asynSuccess;
 	char escapedbuff[NBUFF];
-	char* rxBuffer;
-	int scanned, connected;
+	const char* rxBuffer;
+	int scanned;
 	pasynUser->timeout = TIMEOUT;
-	// wait for a response on the message queue
-	if (epicsMessageQueueReceiveWithTimeout(this->msgQId, &rxBuffer,
-			sizeof(&rxBuffer), TIMEOUT) > 0) {
+	// wait for a response on the message ring
+	if ((rxBuffer = this->msgRing->waitSlot(TIMEOUT, NULL)) != NULL) {
 		// scan the return
 		if (addr == NULL) {
 			scanned = (strcmp(rxBuffer, format) == 0);
@@ -695,19 +1974,26 @@ asynStatus zebra::receive(const char* format, int *addr, int *value) {
 		} else {
 			scanned = sscanf(rxBuffer, format, addr, value);
 		}
-		if (!scanned) {
+		if (!scanned && addr != NULL && sscanf(rxBuffer, "E1%*[RW]%02X", addr) == 1) {
+			asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+					"%s:%s: Zebra rejected '%s' on addr %02X\n", driverName, functionName, format, *addr);
+			status = asynError;
+		} else if (!scanned) {
 			epicsStrnEscapedFromRaw(escapedbuff, NBUFF, rxBuffer,
 					strlen(rxBuffer));
 			asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
 					"%s:%s: Expected '%s', got '%s'\n", driverName, functionName, format, escapedbuff);
+			epicsAtomicIncrIntT(&this->statMalformed);
 			status = asynError;
 		}
-		setIntegerParam(zebraIsConnected, 1);
-		free(rxBuffer);
+		this->connected = 1;
+		this->msgRing->releaseSlot();
 	} else {
-		getIntegerParam(zebraIsConnected, &connected);
-		if (connected) {
-			setIntegerParam(zebraIsConnected, 0);
+		if (this->connected) {
+			this->connected = 0;
+			// We don't know what happened while we weren't talking
+			epicsAtomicSetIntT(&this->staticStale, 1);
+			epicsAtomicSetIntT(&this->framingStale, 1);
 			asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
 					"%s:%s: No response from zebra\n", driverName, functionName);
 		}
@@ -740,12 +2026,7 @@ asynStatus zebra::receiveGetReg(const reg *r, int *value) {
 	if (status == asynSuccess) {
 		if (addr == r->addr) {
 			// Good message, everything ok
-			setIntegerParam(REG2PARAM(r), *value);
-			// If it is a mux, set the string representation from the system bus
-			if (r->type	== regMux && *value >= 0 && (unsigned int)(*value) < NSYSBUS) {
-				setStringParam (REG2PARAMSTR(r), bus_lookup[*value]);
-			}
-			setIntegerParam(zebraIsConnected, 1);
+			this->setRegParam(r, *value);
 			status = asynSuccess;
 		} else {
 			asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
@@ -760,17 +2041,215 @@ asynStatus zebra::receiveGetReg(const reg *r, int *value) {
 	return status;
 }
 
-/* This function gets the value of a register
+/* This function sets the params for register r from a value read from zebra
  called with the lock taken */
-asynStatus zebra::getReg(const reg *r, int *value) {
-	//const char *functionName = "sendGetReg";
-	asynStatus status = this->sendGetReg(r);
-	if (status == asynSuccess) {
-		status = this->receiveGetReg(r, value);
+void zebra::setRegParam(const reg *r, int value) {
+	setIntegerParam(REG2PARAM(r), value);
+	// If the channels being captured have changed, redo the decode plan
+	if (REG2PARAM(r) == this->capParam && (value & ((1 << NARRAYS) - 1)) != this->planCap) {
+		this->planValid = 0;
+	}
+	// If it is a mux, set the string representation from the system bus
+	if (r->type	== regMux && value >= 0 && (unsigned int)(value) < NSYSBUS) {
+		setStringParam (REG2PARAMSTR(r), bus_lookup[value]);
+	}
+}
+
+/* This function reads the n registers reg_lookup[idx[0..n-1]] into values,
+ * keeping up to window read requests in flight and matching each reply to its
+ * request by address, as zebra always replies with the address it was asked
+ * for. Any register that couldn't be read gets a value of -1
+ called with the comms lock taken */
+asynStatus zebra::readRegs(const int *idx, int n, int window, int *values) {
+	const char *functionName = "readRegs";
+	int inflight[NWINDOW];
+	epicsTimeStamp sentAt[NWINDOW];
+	int sent = 0, ninflight = 0, addr, value, i, rejected = 0;
+	asynStatus status = asynSuccess;
+	if (window < 1) window = 1;
+	if (window > NWINDOW) window = NWINDOW;
+	for (i = 0; i < n; i++) values[i] = -1;
+	while (sent < n || ninflight > 0) {
+		// Keep the window full
+		while (sent < n && ninflight < window && status == asynSuccess) {
+			status = this->sendGetReg(&(reg_lookup[idx[sent]]));
+			if (status == asynSuccess) {
+				epicsTimeGetCurrent(&sentAt[ninflight]);
+				inflight[ninflight++] = sent++;
+			}
+		}
+		if (ninflight == 0) break;
+		// Wait for the next reply, if there isn't one then give up on the rest
+		addr = -1;
+		status = this->receive("R%02X%04X", &addr, &value);
+		if (status == asynTimeout) break;
+		// Junk doesn't answer anything, so wait for the next one
+		if (status != asynSuccess && addr < 0) continue;
+		for (i = 0; i < ninflight && reg_lookup[idx[inflight[i]]].addr != addr; i++);
+		if (i < ninflight) {
+			// A rejected read is answered too, it just has no value
+			if (status == asynSuccess) {
+				values[inflight[i]] = value;
+				zebraHistAddSince(this->statReadRtt, &sentAt[i]);
+			} else {
+				rejected++;
+			}
+			sentAt[i] = sentAt[--ninflight];
+			inflight[i] = inflight[ninflight];
+			status = asynSuccess;
+		} else {
+			asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+					"%s:%s: Unexpected response on addr %02X\n", driverName, functionName, addr);
+		}
+	}
+	return (status == asynSuccess && rejected) ? asynError : status;
+}
+
+/* This function says if r is the low half of a 32-bit value, these are
+ * always followed in reg_lookup by their high half */
+static int isLowHalf(const reg *r) {
+	size_t len = strlen(r->str);
+	const reg *hi = r + 1;
+	return len > 2 && strcmp(r->str + len - 2, "LO") == 0 && hi < reg_lookup + NREGS
+			&& strncmp(r->str, hi->str, len - 2) == 0 && strcmp(hi->str + len - 2, "HI") == 0;
+}
+
+/* This function queues a register write for the write thread, a later write
+ * to the same register replaces one that hasn't been sent yet, unless a
+ * command was queued after it or it is a command itself. If the queue is
+ * full it waits for the write thread, or refuses the write if a transaction
+ * is open
+ called with the lock taken */
+asynStatus zebra::bufferWrite(const reg *r, int value) {
+	const char *functionName = "bufferWrite";
+	asynStatus status = asynSuccess;
+	if (r->type == regRO) {
+		return asynError;
+	}
+	for (int i = this->transN - 1; i >= 0 && r->type != regCmd; i--) {
+		if (this->transRegs[i] == r) {
+			this->transVals[i] = value;
+			this->writeSeq++;
+			return asynSuccess;
+		}
+		if (this->transRegs[i]->type == regCmd) break;
+	}
+	if (this->transN == NTRANS && this->transOpen) {
+		// Sending some of it would split the transaction, so refuse this
+		// write and make TRANS_COMMIT report it too
+		int *fail = this->writeFails[this->writeNfail++ % NWRITEFAILS];
+		asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+				"%s:%s: Transaction is full, %s not written\n", driverName, functionName, r->str);
+		fail[0] = this->writeSeq++;
+		fail[1] = this->writeSeq;
+		return asynError;
+	}
+	while (this->transN == NTRANS) {
+		// No more room, so wait for the write thread to send what we have got
+		epicsEventSignal(this->writeEvent);
+		status = this->waitWrites(this->writeSeq);
 	}
+	this->transRegs[this->transN] = r;
+	this->transVals[this->transN++] = value;
+	this->writeSeq++;
 	return status;
 }
 
+/* This function waits until the write thread has sent everything queued so
+ * far, releasing the lock while it does. Returns an error if any write queued
+ * after sequence number since failed
+ called with the lock taken */
+asynStatus zebra::waitWrites(int since) {
+	int seq = this->writeSeq, *fail;
+	epicsTimeStamp start, end;
+	epicsTimeGetCurrent(&start);
+	while (this->writeDoneSeq - seq < 0) {
+		this->unlock();
+		epicsEventWait(this->writeDoneEvent);
+		this->lock();
+	}
+	// So writeInt32 doesn't count this as holding the lock
+	epicsTimeGetCurrent(&end);
+	this->unlockedTime += epicsTimeDiffInSeconds(&end, &start);
+	for (int i = 0; i < this->writeNfail && i < NWRITEFAILS; i++) {
+		fail = this->writeFails[i];
+		if (fail[0] - seq < 0 && fail[1] - since > 0) {
+			return asynError;
+		}
+	}
+	return asynSuccess;
+}
+
+/* This function sends n register writes back to back, keeping up to window in
+ * flight and matching the acks by address, then reads back all the registers
+ * that were written in one pipelined burst. The readback of regs[i] goes in
+ * values[i], or -1 for commands and anything that couldn't be read
+ called with the comms lock taken */
+asynStatus zebra::writeRegs(const reg **regs, const int *vals, int n, int window, int *values) {
+	const char *functionName = "writeRegs";
+	const reg *inflight[NWINDOW];
+	epicsTimeStamp sentAt[NWINDOW];
+	int sent = 0, ninflight = 0, addr, i, nrb = 0, idx[NTRANS], rb[NTRANS], rbvals[NTRANS], rejected = 0;
+	asynStatus status = asynSuccess, result = asynSuccess;
+	if (window < 1) window = 1;
+	if (window > NWINDOW) window = NWINDOW;
+	while (sent < n || ninflight > 0) {
+		// Keep the window full
+		while (sent < n && ninflight < window && status == asynSuccess) {
+			status = this->sendSetReg(regs[sent], vals[sent]);
+			if (status == asynSuccess) {
+				epicsTimeGetCurrent(&sentAt[ninflight]);
+				inflight[ninflight++] = regs[sent++];
+			}
+		}
+		if (ninflight == 0) break;
+		// Wait for the next ack, if there isn't one then give up on the rest
+		addr = -1;
+		status = this->receive("W%02XOK", &addr, NULL);
+		if (status == asynTimeout) break;
+		// Junk doesn't answer anything, so wait for the next one
+		if (status != asynSuccess && addr < 0) continue;
+		for (i = 0; i < ninflight && inflight[i]->addr != addr; i++);
+		if (i < ninflight) {
+			// A rejected write is a failed ack, count it and carry on
+			if (status == asynSuccess) {
+				zebraHistAddSince(this->statWriteRtt, &sentAt[i]);
+			} else {
+				rejected++;
+			}
+			sentAt[i] = sentAt[--ninflight];
+			inflight[i] = inflight[ninflight];
+			status = asynSuccess;
+		} else {
+			asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+					"%s:%s: Unexpected response on addr %02X\n", driverName, functionName, addr);
+		}
+	}
+	if (sent < n || ninflight > 0) {
+		asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+				"%s:%s: Only %d of %d register writes acknowledged\n", driverName, functionName, sent - ninflight, n);
+		result = asynError;
+	}
+	if (rejected) {
+		asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+				"%s:%s: Zebra rejected %d of %d register writes\n", driverName, functionName, rejected, n);
+		result = asynError;
+	}
+	// Now read back everything we wrote that isn't a command
+	for (i = 0; i < n; i++) {
+		values[i] = -1;
+		if (regs[i]->type != regCmd) {
+			rb[nrb] = i;
+			idx[nrb++] = (int) (regs[i] - reg_lookup);
+		}
+	}
+	status = this->readRegs(idx, nrb, window, rbvals);
+	for (i = 0; i < nrb; i++) {
+		values[rb[i]] = rbvals[i];
+	}
+	return result ? result : status;
+}
+
 /* This function sets the value of a register
  called with the lock taken */
 asynStatus zebra::sendSetReg(const reg *r, int value) {
@@ -799,7 +2278,6 @@ asynStatus zebra::receiveSetReg(const reg *r) {
 	if (status == asynSuccess) {
 		if (addr == r->addr) {
 			// Good message, everything ok
-			setIntegerParam(zebraIsConnected, 1);
 			status = asynSuccess;
 		} else {
 			asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
@@ -814,21 +2292,6 @@ asynStatus zebra::receiveSetReg(const reg *r) {
 	return status;
 }
 
-/* This function sets the value of a register
- called with the lock taken */
-asynStatus zebra::setReg(const reg *r, int value) {
-	const char *functionName = "setReg";
-	asynStatus status = this->sendSetReg(r, value);
-	if (status == asynSuccess) {
-		status = this->receiveSetReg(r);
-	}
-	if (status) {
-		asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
-				"%s:%s: Could not set %s to value %d\n", driverName, functionName, r->str, value);
-	}
-	return status;
-}
-
 /* This function stores to flash
  called with the lock taken */
 asynStatus zebra::flashCmd(const char * cmd) {
@@ -847,105 +2310,204 @@ asynStatus zebra::flashCmd(const char * cmd) {
 	return status;
 }
 
-/* Write the config of a zebra to a file
+/* Capture the config of a zebra into the selected bank from the register
+ * values we last read, and get the config task to save it to a file
  * called with the lock taken
  */
 asynStatus zebra::configWrite(const char* str) {
-	asynStatus status = asynSuccess;
-	const reg *r;
-	int value;
-	FILE *file;
 	char buff[NBUFF];
 	if (this->doneInit != 1) {
 		setStringParam(zebraConfigStatus, "Too soon, initial poll not completed, wait a minute");
 		callParamCallbacks();
 		return asynError;
 	}
-	epicsSnprintf(buff, NBUFF, "Writing '%s'", str);
+	for (unsigned int i = 0; i < NREGS; i++) {
+		this->bankRegs[this->bank][i] = -1;
+		if (i < NREGS - FASTREGS) {
+			getIntegerParam(REG2PARAM(&(reg_lookup[i])), &(this->bankRegs[this->bank][i]));
+		}
+	}
+	strncpy(this->bankNames[this->bank], str, NBUFF - 1);
+	this->bankNames[this->bank][NBUFF - 1] = '\0';
+	this->bankSave[this->bank] = 1;
+	this->wakeConfig();
+	setStringParam(zebraConfigBankName, this->bankNames[this->bank]);
+	epicsSnprintf(buff, NBUFF, "Saving '%s'", str);
 	setStringParam(zebraConfigStatus, buff);
 	callParamCallbacks();
-	file = fopen(str, "w");
-	if (file == NULL) {
-		epicsSnprintf(buff, NBUFF, "Can't open '%s'", str);
-		setStringParam(zebraConfigStatus, buff);
-		callParamCallbacks();
-		return asynError;
+	return asynSuccess;
+}
+
+/* This is the function that will be run for the config task */
+void zebra::configTask() {
+	while (true) {
+		epicsEventWait(this->configEvent);
+		this->configOnce();
 	}
-	fprintf(file, "; Setup for a zebra box\n");
-	fprintf(file, "[regs]\n");
-	for (unsigned int i = 0; i < NREGS - FASTREGS; i++) {
-		r = &(reg_lookup[i]);
-		getIntegerParam(REG2PARAM(r), &value);
-		fprintf(file, "%s = %d", r->str, value);
-		if (r->type == regMux && value >= 0 && (unsigned int) value < NSYSBUS) {
-			fprintf(file, " ; %s", bus_lookup[value]);
+}
+
+/* This saves any banks captured by configWrite, writing to a temporary file
+ * without the lock then renaming it so there is never a half written config
+ * file. There is nothing more to do until configWrite wakes it again.
+ * It is run by the config thread, or as a job on the shared workers */
+double zebra::configOnce() {
+	const char *functionName = "configOnce";
+	char name[NBUFF], tmpName[NBUFF + 4], buff[NBUFF];
+	int regs[NREGS], ok;
+	const reg *r;
+	FILE *file;
+	this->lock();
+	for (int b = 0; b < NBANKS; b++) {
+		if (!this->bankSave[b]) continue;
+		// Take a copy so the bank can be captured again while we write
+		this->bankSave[b] = 0;
+		strcpy(name, this->bankNames[b]);
+		memcpy(regs, this->bankRegs[b], sizeof(regs));
+		this->unlock();
+		epicsSnprintf(tmpName, sizeof(tmpName), "%s.tmp", name);
+		file = fopen(tmpName, "w");
+		ok = (file != NULL);
+		if (ok) {
+			fprintf(file, "; Setup for a zebra box\n");
+			fprintf(file, "[regs]\n");
+			for (unsigned int i = 0; i < NREGS - FASTREGS; i++) {
+				r = &(reg_lookup[i]);
+				fprintf(file, "%s = %d", r->str, regs[i]);
+				if (r->type == regMux && regs[i] >= 0 && (unsigned int) regs[i] < NSYSBUS) {
+					fprintf(file, " ; %s", bus_lookup[regs[i]]);
+				}
+				fprintf(file, "\n");
+			}
+			ok = (fclose(file) == 0) && (rename(tmpName, name) == 0);
+			if (!ok) {
+				remove(tmpName);
+			}
 		}
-		fprintf(file, "\n");
+		this->lock();
+		if (ok) {
+			epicsSnprintf(buff, NBUFF, "Saved '%s'", name);
+		} else {
+			epicsSnprintf(buff, NBUFF, "Can't write '%s'", name);
+			asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+					"%s:%s: %s\n", driverName, functionName, buff);
+		}
+		setStringParam(zebraConfigStatus, buff);
+		callParamCallbacks();
 	}
-	fclose(file);
-	// Wait so people notice it's doing something!
-	epicsThreadSleep(1);
-	setStringParam(zebraConfigStatus, "Done");
-	callParamCallbacks();
-	return status;
+	// Nothing more to do until configWrite wakes us
+	this->unlock();
+	return 60.0;
 }
 
-/* Read the config of a zebra from a zebra
+/* Read the config of a zebra from a file into the selected bank, then write
+ * it to zebra
  * called with the lock taken
  */
 asynStatus zebra::configRead(const char* str) {
 	char buff[NBUFF];
 	epicsSnprintf(buff, NBUFF, "Reading '%s'", str);
 	setStringParam(zebraConfigStatus, buff);
+	setIntegerParam(zebraConfigProgress, 0);
 	callParamCallbacks();
-	for (configPhase = 0; configPhase < 4; configPhase++) {
-		if (ini_parse(str, configLineC, this) < 0) {
-			epicsSnprintf(buff, NBUFF, "Error reading '%s'", str);
+	// Parse the whole file once, -1 means not in the file
+	for (unsigned int i = 0; i < NREGS; i++) {
+		this->configImage[i] = -1;
+	}
+	if (ini_parse(str, configLineC, this) < 0) {
+		epicsSnprintf(buff, NBUFF, "Error reading '%s'", str);
+		setStringParam(zebraConfigStatus, buff);
+		callParamCallbacks();
+		return asynError;
+	}
+	memcpy(this->bankRegs[this->bank], this->configImage, sizeof(this->configImage));
+	strncpy(this->bankNames[this->bank], str, NBUFF - 1);
+	this->bankNames[this->bank][NBUFF - 1] = '\0';
+	setStringParam(zebraConfigBankName, this->bankNames[this->bank]);
+	return this->configApply(this->bankRegs[this->bank]);
+}
+
+/* Write the writeable registers in image that differ from what we last read
+ * from zebra, -1 in image means leave it alone. They are written a window at
+ * a time so progress can be shown, and read back to check them
+ * called with the lock taken, takes the comms lock for each window
+ */
+asynStatus zebra::configApply(const int *image) {
+	char buff[NBUFF];
+	const reg *regs[NWINDOW];
+	int vals[NWINDOW], values[NWINDOW], todo[NREGS], ntodo = 0, done, n, window, value;
+	asynStatus status = asynSuccess;
+	epicsTimeStamp start, end;
+	// Only write what is different, unless we haven't read everything yet
+	for (unsigned int i = 0; i < NREGS; i++) {
+		if (image[i] < 0 || (reg_lookup[i].type != regMux && reg_lookup[i].type != regRW)) continue;
+		// A param that has never been set has no value to compare with
+		if (this->doneInit != 1 || getIntegerParam(REG2PARAM(&(reg_lookup[i])), &value) != asynSuccess
+				|| value != image[i]) {
+			todo[ntodo++] = i;
+		}
+	}
+	getIntegerParam(zebraPollWindow, &window);
+	for (done = 0; done < ntodo; done += n) {
+		epicsSnprintf(buff, NBUFF, "Writing %d of %d changed registers", done + 1, ntodo);
+		setStringParam(zebraConfigStatus, buff);
+		setIntegerParam(zebraConfigProgress, done * 100 / ntodo);
+		callParamCallbacks();
+		n = (ntodo - done < window) ? ntodo - done : window;
+		for (int i = 0; i < n; i++) {
+			regs[i] = &(reg_lookup[todo[done + i]]);
+			vals[i] = image[todo[done + i]];
+		}
+		// Don't hold up everyone else while we talk to zebra
+		this->unlock();
+		epicsTimeGetCurrent(&start);
+		epicsMutexMustLock(this->commsLock);
+		status = this->writeRegs(regs, vals, n, window, values);
+		epicsMutexUnlock(this->commsLock);
+		epicsTimeGetCurrent(&end);
+		this->lock();
+		this->unlockedTime += epicsTimeDiffInSeconds(&end, &start);
+		for (int i = 0; i < n; i++) {
+			if (values[i] >= 0) {
+				this->setRegParam(regs[i], values[i]);
+			}
+			if (status == asynSuccess && values[i] != vals[i]) {
+				status = asynError;
+			}
+		}
+		this->readbackSeq++;
+		if (status) {
+			epicsSnprintf(buff, NBUFF, "Error writing registers");
+			for (int i = 0; i < n; i++) {
+				if (values[i] != vals[i]) {
+					epicsSnprintf(buff, NBUFF, "Error setting param %s", regs[i]->str);
+					break;
+				}
+			}
 			setStringParam(zebraConfigStatus, buff);
 			callParamCallbacks();
 			return asynError;
 		}
 	}
-	setStringParam(zebraConfigStatus, "Done");
+	epicsSnprintf(buff, NBUFF, "Done, %d registers changed", ntodo);
+	setStringParam(zebraConfigStatus, buff);
+	setIntegerParam(zebraConfigProgress, 100);
 	callParamCallbacks();
 	return asynSuccess;
 }
 
+/* Called by ini_parse for each line of a config file, puts the value of each
+ * writeable register in configImage
+ * called with the lock taken */
 int zebra::configLine(const char* section, const char* name,
 		const char* value) {
 	char buff[NBUFF];
-	asynStatus status;
 	if (strcmp(section, "regs") == 0) {
-		int param, check;
-		if (findParam(name, &param) == asynSuccess) {
-			regType type = (PARAM2REG(param))->type;
-			if (type == regMux || type == regRW) {
-				switch (configPhase) {
-				case 0:
-					status = this->sendSetReg(PARAM2REG(param), atoi(value));
-					break;
-				case 1:
-					status = this->receiveSetReg(PARAM2REG(param));
-					break;
-				case 2:
-					status = this->sendGetReg(PARAM2REG(param));
-					epicsThreadSleep(DELAYMULTIREAD);
-					break;
-				case 3:
-					status = this->receiveGetReg(PARAM2REG(param), &check);
-					if (status == asynSuccess && atoi(value) != check) status = asynError;
-					break;
-				default:
-					status = asynError;
-					break;
-				}
-				if (status) {
-					epicsSnprintf(buff, NBUFF, "Error setting param %s", name);
-					setStringParam(zebraConfigStatus, buff);
-					callParamCallbacks();
-					// Prob comms error, return error
-					return 0;
-				}
+		int param;
+		if (findParam(name, &param) == asynSuccess && param >= this->zebraReg[0]
+				&& param <= this->zebraReg[NREGS - 1]) {
+			const reg *r = PARAM2REG(param);
+			if (r->type == regMux || r->type == regRW) {
+				this->configImage[r - reg_lookup] = atoi(value) & 0xFFFF;
 			}
 		} else {
 			epicsSnprintf(buff, NBUFF, "Can't find param %s", name);
@@ -970,16 +2532,30 @@ asynStatus zebra::writeInt32(asynUser *pasynUser, epicsInt32 value) {
 	const char *functionName = "writeInt32";
 	asynStatus status = asynError;
 	char buff[NBUFF];
+	int wait;
+	epicsTimeStamp start, end;
+	epicsTimeGetCurrent(&start);
+	this->unlockedTime = 0;
 
 	/* Any work we need to do */
 	int param = pasynUser->reason;
 	if (param >= this->zebraReg[0] && param < this->zebraReg[NREGS - 1]) {
 		const reg *r = PARAM2REG(param);
-		status = this->setReg(r, value);
-		if (status == asynSuccess && r->type != regCmd) {
-		    // do this so we always get an update on the RBV field, essential for clamping 32-bit fields to MRES
-    		setIntegerParam(param, -1);
-			status = this->getReg(r, &value);
+		int since = this->writeSeq;
+		// Queue it for the write thread. Everything in a transaction is held
+		// back until TRANS_COMMIT. If nobody is waiting for it the low half
+		// of a 32-bit value is held back for a tick so it can go out with
+		// its high half, a caller that waits gets it sent on its own, so
+		// use a transaction to be sure a pair goes together
+		status = this->bufferWrite(r, value);
+		if (status == asynSuccess && !this->transOpen) {
+			getIntegerParam(zebraWriteWait, &wait);
+			if (wait || !isLowHalf(r)) {
+				epicsEventSignal(this->writeEvent);
+			}
+			if (wait) {
+				status = this->waitWrites(since);
+			}
 		}
 		if (strcmp(r->str, "SYS_RESET") == 0) {
 			// Reset called, so stop waveform processing
@@ -987,15 +2563,37 @@ asynStatus zebra::writeInt32(asynUser *pasynUser, epicsInt32 value) {
 			// Setting NumDown to -1 will trigger a waveform update even if
 			// the last waveform sent was the same as this one
 			setIntegerParam(zebraNumDown, -1);
-			this->callbackWaveforms();
+			this->callbackWaveforms(1);
+		}
+	} else if (this->transOpen && (param == zebraStore || param == zebraRestore
+			|| param == zebraConfigRead || param == zebraConfigWrite || param == zebraConfigApply)) {
+		// These would send the transaction with them, so it must be committed first
+		const char *name;
+		getParamName(param, &name);
+		asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+				"%s:%s: Can't %s with a transaction open, TRANS_COMMIT it first\n",
+				driverName, functionName, name);
+		if (param != zebraStore && param != zebraRestore) {
+			setStringParam(zebraConfigStatus, "Transaction open, commit it first");
+		}
+		status = asynError;
+	} else if (param == zebraStore || param == zebraRestore) {
+		// Anything queued must get there first
+		epicsEventSignal(this->writeEvent);
+		this->waitWrites(this->writeSeq);
+		epicsMutexMustLock(this->commsLock);
+		status = this->flashCmd((param == zebraStore) ? "S" : "L");
+		epicsMutexUnlock(this->commsLock);
+		if (param == zebraRestore) {
+			// Every register has been loaded from flash, so read them all again
+			epicsAtomicSetIntT(&this->staticStale, 1);
 		}
-	} else if (param == zebraStore) {
-		status = this->flashCmd("S");
-	} else if (param == zebraRestore) {
-		status = this->flashCmd("L");		
 	} else if (param == zebraConfigRead || param == zebraConfigWrite) {
 		char fileName[NBUFF];
 		getStringParam(zebraConfigFile, NBUFF, fileName);
+		// Anything queued must get there first
+		epicsEventSignal(this->writeEvent);
+		this->waitWrites(this->writeSeq);
 		if (param == zebraConfigRead) {
 			status = this->configRead(fileName);
 		} else {
@@ -1007,76 +2605,847 @@ asynStatus zebra::writeInt32(asynUser *pasynUser, epicsInt32 value) {
 			asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
 					"%s:%s: %s\n", driverName, functionName, buff);
 		}
+	} else if (param == zebraConfigBank) {
+		if (value >= 0 && value < NBANKS) {
+			this->bank = value;
+			setStringParam(zebraConfigBankName, this->bankNames[value]);
+			status = setIntegerParam(param, value);
+		}
+	} else if (param == zebraConfigApply) {
+		if (this->bankNames[this->bank][0] == '\0') {
+			epicsSnprintf(buff, NBUFF, "Config bank %d is empty", this->bank);
+			setStringParam(zebraConfigStatus, buff);
+		} else {
+			// Anything queued must get there first
+			epicsEventSignal(this->writeEvent);
+			this->waitWrites(this->writeSeq);
+			setIntegerParam(zebraConfigProgress, 0);
+			status = this->configApply(this->bankRegs[this->bank]);
+		}
+	} else if (param == zebraTransBegin) {
+		// Everything up to TRANS_COMMIT is buffered
+		if (!this->transOpen) {
+			this->transSeq = this->writeSeq;
+		}
+		this->transOpen = 1;
+		status = asynSuccess;
+	} else if (param == zebraTransCommit) {
+		this->transOpen = 0;
+		epicsEventSignal(this->writeEvent);
+		getIntegerParam(zebraWriteWait, &wait);
+		status = wait ? this->waitWrites(this->transSeq) : asynSuccess;
+	} else if (param == zebraWriteWait) {
+		status = setIntegerParam(param, value ? 1 : 0);
 	} else if (param == zebraArrayUpdate) {
-		status = this->callbackWaveforms();
+		status = this->callbackWaveforms(0);
 	} else if (param >= zebraFiltSel[0] && param <= zebraFiltSel[NFILT-1]) {
 		value = value % NSYSBUS;
 		setStringParam(param + NFILT, bus_lookup[value]);
 		status = setIntegerParam(param, value);
+		// Redo just this filter from the raw system bus
+		this->filtSel[param - zebraFiltSel[0]] = value;
+		this->filterColumn(param - zebraFiltSel[0]);
 		// Resend all the waveforms as we have changed the filter
-		setIntegerParam(zebraNumDown, 0);
-		this->callbackWaveforms();
+		setIntegerParam(zebraNumDown, -1);
+		this->callbackWaveforms(0);
+	} else if (param == zebraStream) {
+		// This will take effect at the next arm
+		status = setIntegerParam(param, value ? 1 : 0);
+	} else if (param == zebraDeltaOnly) {
+		status = setIntegerParam(param, value ? 1 : 0);
+	} else if (param == zebraNDEnable) {
+#ifdef ZEBRA_NDARRAY
+		status = setIntegerParam(param, value ? 1 : 0);
+#else
+		if (value) {
+			asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+					"%s:%s: Built without areaDetector, can't send NDArrays\n", driverName, functionName);
+			status = asynError;
+		}
+#endif
+	} else if (param == zebraFileCapture) {
+		// Starting takes effect at the next arm, stopping closes the file now
+		status = setIntegerParam(param, value ? 1 : 0);
+		if (!value && this->fileCapture) {
+			this->fileCapture = 0;
+			this->wakeFile();
+		}
+	} else if (param == zebraPollWindow) {
+		// Can't have more in flight than we can keep track of
+		if (value < 1) value = 1;
+		if (value > NWINDOW) value = NWINDOW;
+		status = setIntegerParam(param, value);
+	} else if (param == zebraWinOffset) {
+		// The window records read it when they next process
+		status = setIntegerParam(param, value);
+	} else if (param == zebraWinCount) {
+		if (value > 0) {
+			status = setIntegerParam(param, value);
+		}
+	} else if (param == zebraPreviewBuckets) {
+		// This will take effect at the next arm, and merging halves the
+		// buckets so there must be an even number of them
+		if (value >= 2 && value <= NPREVIEW) {
+			status = setIntegerParam(param, value & ~1);
+		}
+	} else if (param >= zebraDerOp[0] && param <= zebraDerOp[NDERIVED - 1]) {
+		// This will take effect at the next arm
+		if (value >= ZEBRA_DER_OFF && value < ZEBRA_DER_NOPS) {
+			status = setIntegerParam(param, value);
+		}
+	} else if ((param >= zebraDerA[0] && param <= zebraDerA[NDERIVED - 1])
+			|| (param >= zebraDerB[0] && param <= zebraDerB[NDERIVED - 1])) {
+		if (value >= 0 && value < NARRAYS) {
+			status = setIntegerParam(param, value);
+		}
+	} else if (param == zebraMaxPoints) {
+		// This will take effect at the next arm
+		if (value > 0) {
+			status = setIntegerParam(param, value);
+		}
+	} else if (param == zebraStatReset) {
+		this->resetStats();
+		this->publishStats();
+		status = asynSuccess;
 	}
+	setIntegerParam(zebraIsConnected, this->connected);
 	callParamCallbacks();
+	// Count the time we had the lock, less any time we gave it up
+	epicsTimeGetCurrent(&end);
+	zebraHistAdd(this->statHold[HOLD_WRITE], epicsTimeDiffInSeconds(&end, &start) - this->unlockedTime);
 	return status;
 }
 
-/* This function calls back on the time and position waveform values
+/* Called when asyn clients call pasynFloat64->write().
+ * This function sets the parameter, and redoes the decode plan if it was a
+ * scale or offset */
+asynStatus zebra::writeFloat64(asynUser *pasynUser, epicsFloat64 value) {
+	int param = pasynUser->reason;
+	if ((param == zebraPublishRate || param == zebraPollPeriod || param == zebraVerifyPeriod)
+			&& value <= 0) {
+		return asynError;
+	}
+	asynStatus status = asynPortDriver::writeFloat64(pasynUser, value);
+	if ((param >= zebraScale[0] && param <= zebraScale[NARRAYS - 1])
+			|| (param >= zebraOff[0] && param <= zebraOff[NARRAYS - 1])) {
+		// This will apply from the next point decoded
+		this->planValid = 0;
+	}
+	return status;
+}
+
+/* This function works out which points a window read gets, from
+ * PC_WIN_OFFSET and PC_WIN_COUNT limited to nElements and what is still in
+ * the store. Sets first to the index of the first point and returns the
+ * number of points
  called with the lock taken */
-asynStatus zebra::callbackWaveforms() {
-	int sel, lastUpdatePt;
-	double *src;
+int zebra::windowRange(size_t nElements, int *first) {
+	int offset, count, oldest = 0;
+	getIntegerParam(zebraWinOffset, &offset);
+	getIntegerParam(zebraWinCount, &count);
+	if (this->streaming && this->currPt > this->storePts) {
+		// the ring only has the newest storePts points
+		oldest = this->currPt - this->storePts;
+	}
+	if (offset < 0) {
+		// count back from the newest point
+		offset += this->currPt;
+	}
+	if (offset < oldest) {
+		offset = oldest;
+	}
+	if (count > (int) nElements) {
+		count = (int) nElements;
+	}
+	if (count > this->currPt - offset) {
+		count = this->currPt - offset;
+	}
+	if (count < 0 || this->PCTime == NULL) {
+		count = 0;
+	}
+	*first = offset;
+	setIntegerParam(zebraWinStart, offset);
+	setIntegerParam(zebraWinNum, count);
+	callParamCallbacks();
+	return count;
+}
+
+/* Copy n points of a column of the capture store starting at point first into
+ * value, the store is a ring of len points */
+static void copyWindow(void *value, const void *col, size_t size, int len, int first, int n) {
+	int i = first % len;
+	int n1 = (n < len - i) ? n : len - i;
+	memcpy(value, (const char *) col + i * size, n1 * size);
+	memcpy((char *) value + n1 * size, col, (n - n1) * size);
+}
+
+/* Called when asyn clients call pasynFloat64Array->read().
+ * The window arrays are copied from the capture store when they are read,
+ * anything else gets the base class behaviour */
+asynStatus zebra::readFloat64Array(asynUser *pasynUser, epicsFloat64 *value, size_t nElements, size_t *nIn) {
+	int param = pasynUser->reason, first, n;
+	double *col;
+	if (param == zebraPCTimeWin) {
+		col = this->PCTime;
+	} else if (param >= zebraCapWin[0] && param <= zebraCapWin[NARRAYS - 1]) {
+		col = this->capArrays[param - zebraCapWin[0]];
+	} else {
+		return asynPortDriver::readFloat64Array(pasynUser, value, nElements, nIn);
+	}
+	n = this->windowRange(nElements, &first);
+	// channels that aren't captured have no column
+	if (col == NULL) {
+		n = 0;
+	}
+	if (n > 0) {
+		copyWindow(value, col, sizeof(double), this->streaming ? this->storePts : this->maxPts, first, n);
+	}
+	*nIn = n;
+	return asynSuccess;
+}
+
+/* Called when asyn clients call pasynInt8Array->read().
+ * The filter window arrays are copied from the capture store when they are
+ * read, anything else gets the base class behaviour */
+asynStatus zebra::readInt8Array(asynUser *pasynUser, epicsInt8 *value, size_t nElements, size_t *nIn) {
+	int param = pasynUser->reason, first, n;
+	char *col;
+	if (param >= zebraFiltWin[0] && param <= zebraFiltWin[NFILT - 1]) {
+		col = this->filtArrays[param - zebraFiltWin[0]];
+	} else {
+		return asynPortDriver::readInt8Array(pasynUser, value, nElements, nIn);
+	}
+	n = this->windowRange(nElements, &first);
+	if (col == NULL) {
+		n = 0;
+	}
+	if (n > 0) {
+		copyWindow(value, col, sizeof(char), this->streaming ? this->storePts : this->maxPts, first, n);
+	}
+	*nIn = n;
+	return asynSuccess;
+}
+
+/* This function zeroes the counters, high water marks and histograms */
+void zebra::resetStats() {
+	epicsAtomicSetIntT(&this->statDropped, 0);
+	epicsAtomicSetIntT(&this->statMalformed, 0);
+	epicsAtomicSetIntT(&this->statOverruns, 0);
+	epicsAtomicSetIntT(&this->statLinkLost, 0);
+	epicsAtomicSetIntT(&this->statIntHwm, 0);
+	epicsAtomicSetIntT(&this->statMsgHwm, 0);
+	for (int i = 0; i < ZEBRA_HIST_BINS; i++) {
+		epicsAtomicSetIntT(&this->statReadRtt[i], 0);
+		epicsAtomicSetIntT(&this->statWriteRtt[i], 0);
+		for (int h = 0; h < NHOLD; h++) {
+			epicsAtomicSetIntT(&this->statHold[h][i], 0);
+		}
+	}
+}
+
+/* This function publishes the counters, working out the rates since it was
+ * last called
+ called with the lock taken */
+void zebra::publishStats() {
+	epicsTimeStamp now;
+	int frames = epicsAtomicGetIntT(&this->statFrames);
+	int bytes = epicsAtomicGetIntT(&this->statBytes);
+	epicsTimeGetCurrent(&now);
+	double dt = epicsTimeDiffInSeconds(&now, &this->statLastTime);
+	if (dt > 0) {
+		// unsigned so they still work when the counts wrap
+		setDoubleParam(zebraStatFrameRate, (unsigned int) (frames - this->statLastFrames) / dt);
+		setDoubleParam(zebraStatByteRate, (unsigned int) (bytes - this->statLastBytes) / dt);
+	}
+	this->statLastFrames = frames;
+	this->statLastBytes = bytes;
+	this->statLastTime = now;
+	setIntegerParam(zebraStatIntDepth, this->intRing->pending());
+	setIntegerParam(zebraStatIntHwm, epicsAtomicGetIntT(&this->statIntHwm));
+	setIntegerParam(zebraStatMsgDepth, this->msgRing->pending());
+	setIntegerParam(zebraStatMsgHwm, epicsAtomicGetIntT(&this->statMsgHwm));
+	setIntegerParam(zebraStatDropped, epicsAtomicGetIntT(&this->statDropped));
+	setIntegerParam(zebraStatMalformed, epicsAtomicGetIntT(&this->statMalformed));
+	setIntegerParam(zebraStatOverruns, epicsAtomicGetIntT(&this->statOverruns));
+	setIntegerParam(zebraStatLinkLost, epicsAtomicGetIntT(&this->statLinkLost));
+	doCallbacksInt32Array((epicsInt32 *) this->statReadRtt, ZEBRA_HIST_BINS, zebraStatReadRtt, 0);
+	doCallbacksInt32Array((epicsInt32 *) this->statWriteRtt, ZEBRA_HIST_BINS, zebraStatWriteRtt, 0);
+	for (int h = 0; h < NHOLD; h++) {
+		doCallbacksInt32Array((epicsInt32 *) this->statHold[h], ZEBRA_HIST_BINS, zebraStatHold[h], 0);
+	}
+}
+
+/* This function works out where the next point should go in the capture store,
+ * returning -1 if there is no room for it
+ called with the lock taken */
+int zebra::storeIndex() {
+	if (!this->streaming) {
+		// fixed size store, stop when it is full
+		return (this->currPt < this->maxPts) ? this->currPt : -1;
+	}
+	// streaming store, wrap round as long as the oldest chunk has been handed
+	// off, and written to file if we are doing that
+	int oldest = this->pubPt;
+	if (this->fileCapture && this->filePt < oldest) {
+		oldest = this->filePt;
+	}
+	if (this->currPt - oldest >= this->storePts) {
+		return -1;
+	}
+	return this->currPt % this->storePts;
+}
+
+/* This function publishes the chunks of a streaming store that have filled,
+ * after adding their points to everything that is worked out from them, so
+ * they can be recycled
+ called with the lock taken */
+void zebra::handOffChunks() {
+	this->updateDerived();
+	this->updatePreview();
+	this->updateLiveStats();
+	this->callbackWaveforms(0);
+}
+
+/* This function calls back on the time and position waveform values,
+ * in streaming mode it sends each chunk that has filled since last time,
+ * and the partially filled one if flush is set
+ called with the lock taken */
+asynStatus zebra::callbackWaveforms(int flush) {
+	int lastUpdatePt, start, n, deltaOnly, sent = 0;
+	// Points decoded earlier in this batch may not have been derived yet
+	this->updateDerived();
 	getIntegerParam(zebraNumDown, &lastUpdatePt);
-	if (lastUpdatePt != this->currPt) {
+	getIntegerParam(zebraDeltaOnly, &deltaOnly);
+	if (this->streaming) {
+		while (this->currPt - this->pubPt >= this->chunkPts
+				|| (flush && this->currPt > this->pubPt)) {
+			start = this->pubPt % this->storePts;
+			n = this->currPt - this->pubPt;
+			if (n > this->chunkPts) n = this->chunkPts;
+			if (n > this->storePts - start) n = this->storePts - start;
+			// chunks are already just the new points, so send them as deltas too
+			this->publishDeltas(this->pubPt, start, n);
+			// the chunk is free to be reused as soon as we have sent it
+			this->pubPt += n;
+			setIntegerParam(zebraNumDown, this->pubPt);
+			this->publishWaveforms(start, n);
+			sent = 1;
+		}
+		if (!sent && lastUpdatePt != this->pubPt) {
+			// Forced update with no new data, send empty arrays so that
+			// PC_NUM_DOWN still gets processed
+			setIntegerParam(zebraNumDown, this->pubPt);
+			this->publishWaveforms(0, 0);
+		}
+	} else if (lastUpdatePt != this->currPt) {
 		// printf("Update %d %d\n", this->lastUpdatePt, this->currPt);
 		// store the last update so we don't get repeated updates
 		setIntegerParam(zebraNumDown, this->currPt);
-		/*
-		if (this->currPt < this->maxPts) {
-			// horrible hack for edm plotting
-			// set the last+1 time point to be the same as the last, this
-			// means the last point on the time/pos plot is (last, 0), which
-			// gives a straight line back to (0,0) without confusing the user
-			this->PCTime[this->currPt] = this->PCTime[this->currPt - 1];
-			doCallbacksFloat64Array(this->PCTime, this->currPt + 1, zebraPCTime, 0);
+		if (this->currPt > this->deltaPt) {
+			this->publishDeltas(this->deltaPt, this->deltaPt, this->currPt - this->deltaPt);
+		}
+		// In delta only mode the whole arrays are only sent on arm, disarm,
+		// and filter changes, which all force an update
+		if (!deltaOnly || lastUpdatePt < 0) {
+			this->publishWaveforms(0, this->currPt);
+		}
+	}
+	return asynSuccess;
+}
+
+/* This function does the array callback for n points of column col starting at
+ * start. Columns that were not allocated for this acquisition are sent empty
+ called with the lock taken */
+void zebra::callbackColumn(double *col, int start, int n, int param) {
+	if (col != NULL) {
+		doCallbacksFloat64Array(col + start, n, param, 0);
+	} else {
+		doCallbacksFloat64Array(NULL, 0, param, 0);
+	}
+}
+
+/* Allocate, free or keep a column of the capture store of n elements */
+static void *sizeColumn(void *col, int wanted, int n, size_t size) {
+	if (wanted && col == NULL) {
+		return calloc(n, size);
+	} else if (!wanted && col != NULL) {
+		free(col);
+		return NULL;
+	}
+	return col;
+}
+
+/* This function builds the decode plan from PC_BIT_CAP, the scales and
+ * offsets and the capture columns, so that decoding a frame is just
+ * arithmetic. It is redone whenever any of those change
+ called with the lock taken */
+void zebra::buildPlan() {
+	int cap;
+	getIntegerParam(this->capParam, &cap);
+	this->planCap = cap & ((1 << NARRAYS) - 1);
+	this->planN = 0;
+	this->planBus[0] = this->planBus[1] = 0;
+	for (int a = 0; a < NARRAYS; a++) {
+		// channels that are not captured read as 0
+		this->capLast[a] = 0;
+		if (!(this->planCap >> a & 1)) continue;
+		decodeStep *d = &this->plan[this->planN++];
+		d->a = a;
+		// encoders are signed 32-bit numbers, system bus and dividers unsigned
+		d->isSigned = a < 4;
+		getDoubleParam(zebraScale[a], &d->scale);
+		getDoubleParam(zebraOff[a], &d->off);
+		d->col = this->capArrays[a];
+		if (a == 4 || a == 5) {
+			// keep the raw system bus for the filters, field 0 is the time
+			this->planBus[a - 4] = this->planN;
+		}
+	}
+	this->planValid = 1;
+}
+
+/* This function frees every column of the capture store
+ called with the lock taken */
+void zebra::freeStore() {
+	this->PCTime = (double *) sizeColumn(this->PCTime, 0, 0, 0);
+	for (int a = 0; a < NARRAYS; a++) {
+		this->capArrays[a] = (double *) sizeColumn(this->capArrays[a], 0, 0, 0);
+	}
+	for (int a = 0; a < NFILT; a++) {
+		this->filtArrays[a] = (char *) sizeColumn(this->filtArrays[a], 0, 0, 0);
+	}
+	for (int a = 0; a < 2; a++) {
+		this->sysBus[a] = (epicsUInt32 *) sizeColumn(this->sysBus[a], 0, 0, 0);
+	}
+	for (int d = 0; d < NDERIVED; d++) {
+		this->derArrays[d] = (double *) sizeColumn(this->derArrays[d], 0, 0, 0);
+	}
+}
+
+/* This function sizes the capture store at the start of an acquisition. It is
+ * MAX_POINTS long, and only has columns for the channels enabled in cap
+ called with the lock taken */
+asynStatus zebra::allocateStore(int cap) {
+	const char *functionName = "allocateStore";
+	int maxPts, stream, ok = 1, sys = (cap >> 4) & 3;
+	// The columns are about to move, so the decode plan must be redone
+	this->planValid = 0;
+	getIntegerParam(zebraMaxPoints, &maxPts);
+	getIntegerParam(zebraStream, &stream);
+	if (maxPts < 1) {
+		maxPts = 1;
+	}
+	if (stream && maxPts < NBATCH) {
+		// A streaming store must hold a whole batch of interrupts as a chunk
+		// can't be handed off in the middle of a point
+		asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+				"%s:%s: MAX_POINTS %d is too small to stream, using %d\n", driverName, functionName, maxPts, NBATCH);
+		maxPts = NBATCH;
+	}
+	if (maxPts != this->maxPts) {
+		// Changing size, so throw all the old columns away
+		this->freeStore();
+		this->maxPts = maxPts;
+	}
+	this->PCTime = (double *) sizeColumn(this->PCTime, 1, maxPts, sizeof(double));
+	ok = ok && this->PCTime != NULL;
+	for (int a = 0; a < NARRAYS; a++) {
+		this->capArrays[a] = (double *) sizeColumn(this->capArrays[a], cap >> a & 1, maxPts, sizeof(double));
+		ok = ok && (this->capArrays[a] != NULL || !(cap >> a & 1));
+	}
+	// The filters are made from the system bus so are only needed if we capture it
+	for (int a = 0; a < NFILT; a++) {
+		this->filtArrays[a] = (char *) sizeColumn(this->filtArrays[a], sys != 0, maxPts, sizeof(char));
+		ok = ok && (this->filtArrays[a] != NULL || sys == 0);
+	}
+	for (int a = 0; a < 2; a++) {
+		this->sysBus[a] = (epicsUInt32 *) sizeColumn(this->sysBus[a], sys >> a & 1, maxPts, sizeof(epicsUInt32));
+		ok = ok && (this->sysBus[a] != NULL || !(sys >> a & 1));
+	}
+	for (int d = 0; d < NDERIVED; d++) {
+		int wanted = this->derOp[d] != ZEBRA_DER_OFF;
+		this->derArrays[d] = (double *) sizeColumn(this->derArrays[d], wanted, maxPts, sizeof(double));
+		ok = ok && (this->derArrays[d] != NULL || !wanted);
+	}
+	if (!ok) {
+		asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+				"%s:%s: Can't allocate %d points for PC_BIT_CAP 0x%X\n", driverName, functionName, maxPts, cap);
+		// Free the lot, every point will now be counted as lost
+		this->freeStore();
+		this->maxPts = 0;
+		this->chunkPts = 1;
+		this->storePts = 0;
+		return asynError;
+	}
+	// For streaming, the store is a whole number of chunks
+	this->chunkPts = (maxPts / NCHUNKS > 0) ? maxPts / NCHUNKS : 1;
+	this->storePts = (maxPts / this->chunkPts) * this->chunkPts;
+	return asynSuccess;
+}
+
+/* This function recalculates filter array a from the raw system bus for all
+ * the points in the store, after its selection has changed
+ called with the lock taken */
+void zebra::filterColumn(int a) {
+	const epicsUInt32 *src = this->sysBus[this->filtSel[a] >> 5];
+	const int shift = this->filtSel[a] & 31;
+	char *dst = this->filtArrays[a];
+	int n = this->currPt;
+	if (this->streaming && n > this->storePts) {
+		n = this->storePts;
+	}
+	if (dst == NULL) {
+		// not capturing the system bus this time
+		return;
+	} else if (src == NULL) {
+		// not capturing this half of the system bus
+		memset(dst, 0, n);
+		return;
+	}
+	// Simple loop over contiguous arrays so the compiler can vectorize it
+	for (int i = 0; i < n; i++) {
+		dst[i] = (src[i] >> shift) & 1;
+	}
+}
+
+/* This function does the delta array callbacks for n points, the first of which is
+ * point number firstPt of the acquisition and is at index start in the store.
+ * They are sent in slices of at most NDELTA points, each preceded by its start index
+ called with the lock taken */
+void zebra::publishDeltas(int firstPt, int start, int n) {
+	int slice;
+	this->publishNDArray(firstPt, start, n);
+	while (n > 0) {
+		slice = (n > NDELTA) ? NDELTA : n;
+		setIntegerParam(zebraDeltaStart, firstPt);
+		// Make sure clients get the start index before the data
+		callParamCallbacks();
+		this->callbackColumn(this->PCTime, start, slice, zebraPCTimeDelta);
+		for (int a = 0; a < NARRAYS; a++) {
+			this->callbackColumn(this->capArrays[a], start, slice, zebraCapDelta[a]);
+		}
+		for (int d = 0; d < NDERIVED; d++) {
+			this->callbackColumn(this->derArrays[d], start, slice, zebraDerDelta[d]);
+		}
+		firstPt += slice;
+		start += slice;
+		n -= slice;
+	}
+	this->deltaPt = firstPt;
+}
+
+/* This function sends the same n points as publishDeltas as one NDArray
+ * to any areaDetector plugins, if ND_ENABLE is set
+ called with the lock taken */
+void zebra::publishNDArray(int firstPt, int start, int n) {
+#ifdef ZEBRA_NDARRAY
+	const char *functionName = "publishNDArray";
+	const char *names[NARRAYS + 1];
+	double *cols[NARRAYS + 1], scales[NARRAYS + 1], offs[NARRAYS + 1];
+	int enable, ncols = 0;
+	getIntegerParam(zebraNDEnable, &enable);
+	if (!enable || n <= 0 || this->PCTime == NULL) return;
+	cols[ncols] = this->PCTime;
+	names[ncols] = "PC_TIME";
+	scales[ncols] = 1.0;
+	offs[ncols++] = 0.0;
+	for (int a = 0; a < NARRAYS; a++) {
+		if (this->capArrays[a] == NULL) continue;
+		cols[ncols] = this->capArrays[a];
+		getParamName(zebraCapArrays[a], &names[ncols]);
+		getDoubleParam(zebraScale[a], &scales[ncols]);
+		getDoubleParam(zebraOff[a], &offs[ncols++]);
+	}
+	if (!this->ndArrays->publish(cols, names, scales, offs, ncols, start, n, firstPt, this->acqNum)) {
+		asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+				"%s:%s: No memory for an NDArray of %d points\n", driverName, functionName, n);
+	}
+#endif
+}
+
+/* This function does the array callbacks for n points starting at start
+ called with the lock taken */
+void zebra::publishWaveforms(int start, int n) {
+	/*
+	if (this->currPt < this->maxPts) {
+		// horrible hack for edm plotting
+		// set the last+1 time point to be the same as the last, this
+		// means the last point on the time/pos plot is (last, 0), which
+		// gives a straight line back to (0,0) without confusing the user
+		this->PCTime[this->currPt] = this->PCTime[this->currPt - 1];
+		doCallbacksFloat64Array(this->PCTime, this->currPt + 1, zebraPCTime, 0);
+	} else {
+	*/
+		this->callbackColumn(this->PCTime, start, n, zebraPCTime);
+	//}
+
+	/* The filter arrays are kept up to date as points arrive */
+	for (int a = 0; a < NFILT; a++) {
+		if (this->filtArrays[a] != NULL) {
+			doCallbacksInt8Array(this->filtArrays[a] + start, n,
+					zebraFiltArrays[a], 0);
 		} else {
-		*/
-			doCallbacksFloat64Array(this->PCTime, this->currPt, zebraPCTime, 0);
-		//}
-
-		/* Filter the relevant sys_bus array with filtSel[a] and put the value in filtArray[a] */
-		for (int a = 0; a < NFILT; a++) {
-			getIntegerParam(zebraFiltSel[a], &sel);
-			if (sel < 32) {
-				src = this->capArrays[4]; // SYS_BUS1
-			} else {
-				src = this->capArrays[5]; // SYS_BUS2
-				sel -= 32;
+			doCallbacksInt8Array(NULL, 0, zebraFiltArrays[a], 0);
+		}
+	}
+
+	// derived arrays go first so they are there when NumDown updates
+	for (int d = 0; d < NDERIVED; d++) {
+		this->callbackColumn(this->derArrays[d], start, n, zebraDerArrays[d]);
+	}
+
+	// update capture arrays
+	for (int a = 0; a < NARRAYS; a++) {
+		this->callbackColumn(this->capArrays[a], start, n, zebraCapArrays[a]);
+	}
+
+	// Note no callParamCallbacks. We will forward link from PC_ENC1 to NumDown
+	// so that GDA can monitor NumDown to know when to caget array values
+	// This will then FLNK to ARRAY_ACQ so it knows when acquisition is finished
+}
+
+/* This function empties the preview at the start of an acquisition, sizing
+ * it for PC_PREVIEW_BUCKETS if that has changed
+ called with the lock taken */
+void zebra::resetPreview() {
+	const char *functionName = "resetPreview";
+	int buckets;
+	double *p;
+	getIntegerParam(zebraPreviewBuckets, &buckets);
+	if (buckets != this->previewBuckets) {
+		free(this->previewBuf);
+		// time, then min, max, first and last of every channel
+		this->previewBuf = (double *) calloc(buckets * (1 + 4 * NARRAYS), sizeof(double));
+		if (this->previewBuf == NULL) {
+			asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+					"%s:%s: Can't allocate a preview of %d buckets\n", driverName, functionName, buckets);
+			buckets = 0;
+		}
+		this->previewBuckets = buckets;
+		p = this->previewBuf;
+		this->previewTime = p;
+		for (int a = 0; a < NARRAYS; a++) {
+			this->previewMin[a] = p ? (p += buckets) : NULL;
+			this->previewMax[a] = p ? (p += buckets) : NULL;
+			this->previewFirst[a] = p ? (p += buckets) : NULL;
+			this->previewLast[a] = p ? (p += buckets) : NULL;
+		}
+	}
+	this->previewN = 0;
+	this->previewWidth = 1;
+	this->previewPt = 0;
+	this->previewDirty = 1;
+}
+
+/* This function merges each pair of buckets in a full preview, so each bucket
+ * now covers twice as many points and half of them are free again
+ called with the lock taken */
+void zebra::mergePreview() {
+	int half = this->previewBuckets / 2;
+	for (int b = 0; b < half; b++) {
+		this->previewTime[b] = this->previewTime[2 * b];
+	}
+	for (int a = 0; a < NARRAYS; a++) {
+		if (this->capArrays[a] == NULL) continue;
+		double *lo = this->previewMin[a], *hi = this->previewMax[a];
+		double *first = this->previewFirst[a], *last = this->previewLast[a];
+		for (int b = 0; b < half; b++) {
+			lo[b] = (lo[2 * b + 1] < lo[2 * b]) ? lo[2 * b + 1] : lo[2 * b];
+			hi[b] = (hi[2 * b + 1] > hi[2 * b]) ? hi[2 * b + 1] : hi[2 * b];
+			first[b] = first[2 * b];
+			last[b] = last[2 * b + 1];
+		}
+	}
+	this->previewN = half;
+	this->previewWidth *= 2;
+}
+
+/* This function adds the points decoded since it was last called to the
+ * preview. It must be called before they can be recycled in streaming mode
+ called with the lock taken */
+void zebra::updatePreview() {
+	int len = this->streaming ? this->storePts : this->maxPts;
+	int b, end, n, i0;
+	if (this->previewBuckets == 0 || this->PCTime == NULL) {
+		this->previewPt = this->currPt;
+		return;
+	}
+	while (this->previewPt < this->currPt) {
+		b = this->previewPt / this->previewWidth;
+		if (b >= this->previewBuckets) {
+			this->mergePreview();
+			continue;
+		}
+		// the rest of the points in this bucket that we have got
+		end = (b + 1) * this->previewWidth;
+		if (end > this->currPt) end = this->currPt;
+		n = end - this->previewPt;
+		i0 = this->previewPt % len;
+		if (this->previewPt == b * this->previewWidth) {
+			// first point of a new bucket
+			this->previewTime[b] = this->PCTime[i0];
+			for (int a = 0; a < NARRAYS; a++) {
+				if (this->capArrays[a] == NULL) continue;
+				this->previewMin[a][b] = this->previewMax[a][b] = this->capArrays[a][i0];
+				this->previewFirst[a][b] = this->capArrays[a][i0];
 			}
-			for (int i = 0; i < this->maxPts; i++) {
-				this->filtArrays[a][i] = (((unsigned int)(src[i]+0.5)) >> sel) & 1;				   
+			this->previewN = b + 1;
+		}
+		for (int a = 0; a < NARRAYS; a++) {
+			const double *col = this->capArrays[a];
+			if (col == NULL) continue;
+			double lo = this->previewMin[a][b], hi = this->previewMax[a][b];
+			// the points may wrap round the end of a streaming store
+			for (int k = 0, i = i0; k < n; k++) {
+				if (col[i] < lo) lo = col[i];
+				if (col[i] > hi) hi = col[i];
+				if (++i == len) i = 0;
 			}
-			doCallbacksInt8Array(this->filtArrays[a], this->currPt,
-					zebraFiltArrays[a], 0);
+			this->previewMin[a][b] = lo;
+			this->previewMax[a][b] = hi;
+			this->previewLast[a][b] = col[(i0 + n - 1) % len];
 		}
+		this->previewPt = end;
+		this->previewDirty = 1;
+	}
+}
+
+/* This function does the preview array callbacks, channels that are not being
+ * captured are sent empty
+ called with the lock taken */
+void zebra::publishPreview() {
+	int n = (this->previewBuckets > 0) ? this->previewN : 0;
+	setIntegerParam(zebraPreviewNum, n);
+	setIntegerParam(zebraPreviewWidth, this->previewWidth);
+	callParamCallbacks();
+	doCallbacksFloat64Array(this->previewTime, n, zebraPCTimePreview, 0);
+	for (int a = 0; a < NARRAYS; a++) {
+		int na = (this->capArrays[a] != NULL) ? n : 0;
+		doCallbacksFloat64Array(this->previewMin[a], na, zebraCapPMin[a], 0);
+		doCallbacksFloat64Array(this->previewMax[a], na, zebraCapPMax[a], 0);
+		doCallbacksFloat64Array(this->previewFirst[a], na, zebraCapPFirst[a], 0);
+		doCallbacksFloat64Array(this->previewLast[a], na, zebraCapPLast[a], 0);
+	}
+	this->previewDirty = 0;
+}
+
+/* This function zeroes the live statistics at the start of an acquisition
+ called with the lock taken */
+void zebra::resetLiveStats() {
+	for (int a = 0; a < NARRAYS; a++) {
+		this->liveStats[a].reset();
+	}
+	this->liveDt.reset();
+	this->livePt = 0;
+	this->liveLastT = 0;
+	this->liveDirty = 1;
+}
 
-		// update capture arrays
+/* This function adds the points decoded since it was last called to the live
+ * statistics. It must be called before they can be recycled in streaming mode
+ called with the lock taken */
+void zebra::updateLiveStats() {
+	int len = this->streaming ? this->storePts : this->maxPts;
+	int i0, n;
+	if (this->PCTime == NULL) {
+		this->livePt = this->currPt;
+		return;
+	}
+	while (this->livePt < this->currPt) {
+		// a run of points up to the end of a streaming store
+		i0 = this->livePt % len;
+		n = this->currPt - this->livePt;
+		if (n > len - i0) n = len - i0;
+		this->liveDt.addDiffs(this->PCTime + i0, n, &this->liveLastT, this->livePt > 0);
 		for (int a = 0; a < NARRAYS; a++) {
-			doCallbacksFloat64Array(this->capArrays[a], this->currPt,
-					zebraCapArrays[a], 0);
+			if (this->capArrays[a] != NULL) {
+				this->liveStats[a].add(this->capArrays[a] + i0, n);
+			}
 		}
+		this->livePt += n;
+		this->liveDirty = 1;
+	}
+}
 
-		// Note no callParamCallbacks. We will forward link from PC_ENC1 to NumDown
-		// so that GDA can monitor NumDown to know when to caget array values
-		// This will then FLNK to ARRAY_ACQ so it knows when acquisition is finished
+/* This function publishes the live statistics, converting the intervals
+ * between points to sample rates in Hz with the PC_TIME prescaler
+ called with the lock taken */
+void zebra::publishLiveStats() {
+	int tspre;
+	double unit;
+	const zebraRunStats *s = &this->liveDt;
+	getIntegerParam(this->tspreParam, &tspre);
+	// PC_TIME counts in units of 0.0001 ticks of 50MHz / PC_TSPRE
+	unit = (tspre > 0) ? tspre * 2e-4 : 1.0;
+	setIntegerParam(zebraLiveCount, this->livePt);
+	setDoubleParam(zebraLiveDtMin, s->min);
+	setDoubleParam(zebraLiveDtMax, s->max);
+	setDoubleParam(zebraLiveDtMean, s->mean);
+	setDoubleParam(zebraLiveDtStd, s->std());
+	setDoubleParam(zebraLiveRate, (s->last > 0) ? 1.0 / (s->last * unit) : 0);
+	setDoubleParam(zebraLiveRateAvg, (s->mean > 0) ? 1.0 / (s->mean * unit) : 0);
+	for (int a = 0; a < NARRAYS; a++) {
+		s = &this->liveStats[a];
+		setDoubleParam(zebraCapMin[a], s->min);
+		setDoubleParam(zebraCapMax[a], s->max);
+		setDoubleParam(zebraCapMean[a], s->mean);
+		setDoubleParam(zebraCapStd[a], s->std());
+	}
+	this->liveDirty = 0;
+}
+
+/* This function takes the settings of the derived channels at the start of an
+ * acquisition. Any whose sources are not in cap are turned off
+ called with the lock taken */
+void zebra::latchDerived(int cap) {
+	const char *functionName = "latchDerived";
+	for (int d = 0; d < NDERIVED; d++) {
+		getIntegerParam(zebraDerOp[d], &this->derOp[d]);
+		getIntegerParam(zebraDerA[d], &this->derA[d]);
+		getIntegerParam(zebraDerB[d], &this->derB[d]);
+		getDoubleParam(zebraDerWrap[d], &this->derWrap[d]);
+		getDoubleParam(zebraDerScale[d], &this->derScale[d]);
+		this->derState[d].have = 0;
+		if (this->derOp[d] != ZEBRA_DER_OFF && (!(cap >> this->derA[d] & 1)
+				|| (this->derOp[d] == ZEBRA_DER_SUM && !(cap >> this->derB[d] & 1)))) {
+			asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+					"%s:%s: PC_DER%d needs a channel that PC_BIT_CAP 0x%X does not capture\n",
+					driverName, functionName, d + 1, cap);
+			this->derOp[d] = ZEBRA_DER_OFF;
+		}
+	}
+}
+
+/* This function works out the derived channels for the points decoded since
+ * it was last called, a block at a time
+ called with the lock taken */
+void zebra::updateDerived() {
+	int len = this->streaming ? this->storePts : this->maxPts;
+	int i0, n;
+	if (this->PCTime == NULL) {
+		this->derPt = this->currPt;
+		return;
+	}
+	while (this->derPt < this->currPt) {
+		// a run of points up to the end of a streaming store
+		i0 = this->derPt % len;
+		n = this->currPt - this->derPt;
+		if (n > len - i0) n = len - i0;
+		for (int d = 0; d < NDERIVED; d++) {
+			if (this->derArrays[d] == NULL || this->derOp[d] == ZEBRA_DER_OFF) continue;
+			const double *b = this->capArrays[this->derB[d]];
+			zebraDerive(this->derOp[d], this->capArrays[this->derA[d]] + i0, b ? b + i0 : NULL,
+					this->PCTime + i0, n, this->derWrap[d], this->derScale[d],
+					&this->derState[d], this->derArrays[d] + i0);
+		}
+		this->derPt += n;
 	}
-	return asynSuccess;
 }
 
 /** Configuration command, called directly or from iocsh */
 extern "C" int zebraConfig(const char *portName, const char* serialPortName,
-		int maxPts) {
-	new zebra(portName, serialPortName, maxPts);
+		int maxPts, int queueDepth, int shared) {
+	new zebra(portName, serialPortName, maxPts, queueDepth, shared);
 	return (asynSuccess);
 }
 
@@ -1085,11 +3454,15 @@ static const iocshArg zebraConfigArg0 = { "Port name", iocshArgString };
 static const iocshArg zebraConfigArg1 = { "Serial port name", iocshArgString };
 static const iocshArg zebraConfigArg2 = {
 		"Max number of points to capture in position compare", iocshArgInt };
+static const iocshArg zebraConfigArg3 = {
+		"Number of frames buffered on each receive ring (0=default)", iocshArgInt };
+static const iocshArg zebraConfigArg4 = {
+		"Number of workers shared by all zebras for interrupts, files and config saves (0=own threads)", iocshArgInt };
 static const iocshArg* const zebraConfigArgs[] = { &zebraConfigArg0,
-		&zebraConfigArg1, &zebraConfigArg2 };
-static const iocshFuncDef configzebra = { "zebraConfig", 3, zebraConfigArgs };
+		&zebraConfigArg1, &zebraConfigArg2, &zebraConfigArg3, &zebraConfigArg4 };
+static const iocshFuncDef configzebra = { "zebraConfig", 5, zebraConfigArgs };
 static void configzebraCallFunc(const iocshArgBuf *args) {
-	zebraConfig(args[0].sval, args[1].sval, args[2].ival);
+	zebraConfig(args[0].sval, args[1].sval, args[2].ival, args[3].ival, args[4].ival);
 }
 
 static void zebraRegister(void) {
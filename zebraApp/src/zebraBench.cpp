@@ -0,0 +1,437 @@
+/* zebraBench.cpp
+ * Offline benchmark of the zebra capture path. Frames are replayed from a
+ * file, or made up for a set of PC_BIT_CAP masks, through an in-memory asyn
+ * port that also answers register reads and writes. The real driver reads
+ * them with its readTask and decodes them with its interrupt servicing, so
+ * the numbers are for the code that runs on the beamline.
+ *
+ * usage: zebraBench [-n frames] [-a acquisitions] [-b burst] [-c mask]... [file]
+ *   -n  frames per mask in the throughput run (default 100000)
+ *   -a  acquisitions per mask in the latency run (default 200)
+ *   -b  frames in each latency run acquisition (default 100)
+ *   -c  PC_BIT_CAP mask to run, may be given more than once
+ *       (default 0x1, 0xF, 0x3F and 0x3FF)
+ *   file  replay the P... frames in file instead of making them up, there
+ *       must be a single -c mask that they were captured with
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <epicsTime.h>
+#include <epicsThread.h>
+#include <epicsMutex.h>
+#include <epicsEvent.h>
+#include <epicsStdio.h>
+#include <epicsAtomic.h>
+#include <epicsExit.h>
+#include "asynDriver.h"
+#include "asynOctet.h"
+#include "asynInt32.h"
+#include "asynDrvUser.h"
+#include "asynInt32SyncIO.h"
+
+/* The ports the benchmark makes */
+#define SIMPORT "ZEBRA_BENCH_SIM"
+#define DRVPORT "ZEBRA_BENCH"
+
+/* The max number of masks that can be given with -c */
+#define NMASKS 16
+
+/* The max number of replies to commands that can be waiting */
+#define NREPLIES 64
+
+/* The size of a frame or reply line */
+#define NLINE 128
+
+extern "C" int zebraConfig(const char *portName, const char* serialPortName,
+		int maxPts, int queueDepth, int shared);
+
+#ifdef __GLIBC__
+/* Count every heap allocation made by any thread, glibc lets us get at the
+ * real allocator underneath */
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t n, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+static int nallocs = 0;
+extern "C" void *malloc(size_t size) {
+	epicsAtomicIncrIntT(&nallocs);
+	return __libc_malloc(size);
+}
+extern "C" void *calloc(size_t n, size_t size) {
+	epicsAtomicIncrIntT(&nallocs);
+	return __libc_calloc(n, size);
+}
+extern "C" void *realloc(void *ptr, size_t size) {
+	epicsAtomicIncrIntT(&nallocs);
+	return __libc_realloc(ptr, size);
+}
+#define ALLOCS() epicsAtomicGetIntT(&nallocs)
+#else
+#define ALLOCS() 0
+#endif
+
+/* The simulated zebra. It answers register reads and writes straight away,
+ * and hands out the frames in stream one line at a time when asked */
+typedef struct benchSim {
+	epicsMutexId lock;
+	epicsEventId event;
+	int regs[256];
+	char replies[NREPLIES][NLINE];
+	int replyHead, replyTail;
+	char *stream;
+	size_t streamPos, streamLen;
+	epicsTimeStamp prTime, pxTime;
+} benchSim;
+
+static benchSim sim;
+
+/* Set when ARRAY_ACQ goes back to 0 after a disarm */
+static epicsEventId doneEvent;
+static epicsTimeStamp doneTime;
+
+static void simReport(void *drvPvt, FILE *fp, int details) {
+	fprintf(fp, "zebra benchmark simulator\n");
+}
+
+static asynStatus simConnect(void *drvPvt, asynUser *pasynUser) {
+	pasynManager->exceptionConnect(pasynUser);
+	return asynSuccess;
+}
+
+static asynStatus simDisconnect(void *drvPvt, asynUser *pasynUser) {
+	pasynManager->exceptionDisconnect(pasynUser);
+	return asynSuccess;
+}
+
+/* Answer a command from the driver */
+static asynStatus simWrite(void *drvPvt, asynUser *pasynUser, const char *data,
+		size_t numchars, size_t *nbytesTransfered) {
+	char cmd[NLINE], *reply;
+	unsigned int addr, value;
+	size_t len = (numchars < NLINE - 1) ? numchars : NLINE - 1;
+	memcpy(cmd, data, len);
+	cmd[len] = '\0';
+	epicsMutexMustLock(sim.lock);
+	reply = sim.replies[sim.replyHead];
+	if (sscanf(cmd, "W%02X%04X", &addr, &value) == 2) {
+		sim.regs[addr & 0xFF] = value;
+		epicsSnprintf(reply, NLINE, "W%02XOK", addr);
+	} else if (sscanf(cmd, "R%02X", &addr) == 1) {
+		epicsSnprintf(reply, NLINE, "R%02X%04X", addr, sim.regs[addr & 0xFF]);
+	} else {
+		// Flash store and restore
+		epicsSnprintf(reply, NLINE, "%sOK", cmd);
+	}
+	sim.replyHead = (sim.replyHead + 1) % NREPLIES;
+	epicsMutexUnlock(sim.lock);
+	epicsEventSignal(sim.event);
+	*nbytesTransfered = numchars;
+	return asynSuccess;
+}
+
+/* Hand out the next reply, or the next frame if there are no replies */
+static asynStatus simRead(void *drvPvt, asynUser *pasynUser, char *data,
+		size_t maxchars, size_t *nbytesTransfered, int *eomReason) {
+	const char *line = NULL;
+	size_t len = 0;
+	epicsMutexMustLock(sim.lock);
+	while (true) {
+		if (sim.replyTail != sim.replyHead) {
+			line = sim.replies[sim.replyTail];
+			len = strlen(line);
+			sim.replyTail = (sim.replyTail + 1) % NREPLIES;
+			break;
+		}
+		if (sim.streamPos < sim.streamLen) {
+			line = sim.stream + sim.streamPos;
+			len = strcspn(line, "\n");
+			sim.streamPos += len + 1;
+			if (len == 2 && strncmp(line, "PR", 2) == 0) {
+				epicsTimeGetCurrent(&sim.prTime);
+			} else if (len == 2 && strncmp(line, "PX", 2) == 0) {
+				epicsTimeGetCurrent(&sim.pxTime);
+			}
+			break;
+		}
+		epicsMutexUnlock(sim.lock);
+		if (epicsEventWaitWithTimeout(sim.event, pasynUser->timeout) != epicsEventWaitOK) {
+			*nbytesTransfered = 0;
+			*eomReason = 0;
+			return asynTimeout;
+		}
+		epicsMutexMustLock(sim.lock);
+	}
+	if (len > maxchars) len = maxchars;
+	memcpy(data, line, len);
+	epicsMutexUnlock(sim.lock);
+	*nbytesTransfered = len;
+	*eomReason = ASYN_EOM_EOS;
+	return asynSuccess;
+}
+
+static asynStatus simFlush(void *drvPvt, asynUser *pasynUser) {
+	return asynSuccess;
+}
+
+static asynStatus simSetEos(void *drvPvt, asynUser *pasynUser, const char *eos, int eoslen) {
+	return asynSuccess;
+}
+
+static asynStatus simGetEos(void *drvPvt, asynUser *pasynUser, char *eos, int eossize, int *eoslen) {
+	*eoslen = 0;
+	return asynSuccess;
+}
+
+static asynCommon simCommon = { simReport, simConnect, simDisconnect };
+static asynOctet simOctet;
+static asynInterface simCommonIf = { asynCommonType, &simCommon, NULL };
+static asynInterface simOctetIf = { asynOctetType, &simOctet, NULL };
+
+/* Register the simulator as an asyn port */
+static int simCreate() {
+	sim.lock = epicsMutexMustCreate();
+	sim.event = epicsEventMustCreate(epicsEventEmpty);
+	simOctet.write = simWrite;
+	simOctet.read = simRead;
+	simOctet.flush = simFlush;
+	simOctet.setInputEos = simSetEos;
+	simOctet.getInputEos = simGetEos;
+	simOctet.setOutputEos = simSetEos;
+	simOctet.getOutputEos = simGetEos;
+	if (pasynManager->registerPort(SIMPORT, ASYN_CANBLOCK, 1, 0, 0) != asynSuccess
+			|| pasynManager->registerInterface(SIMPORT, &simCommonIf) != asynSuccess
+			|| pasynOctetBase->initialize(SIMPORT, &simOctetIf, 0, 0, 0) != asynSuccess) {
+		return 0;
+	}
+	return 1;
+}
+
+/* Queue up PR, the frames in frames, then PX, for the driver to read */
+static void simArm(const char *frames, size_t len) {
+	epicsMutexMustLock(sim.lock);
+	free(sim.stream);
+	sim.stream = (char *) malloc(len + 6);
+	memcpy(sim.stream, "PR\n", 3);
+	memcpy(sim.stream + 3, frames, len);
+	memcpy(sim.stream + 3 + len, "PX\n", 3);
+	sim.streamLen = len + 6;
+	sim.streamPos = 0;
+	epicsMutexUnlock(sim.lock);
+	epicsEventSignal(sim.event);
+}
+
+static void acqCallback(void *userPvt, asynUser *pasynUser, epicsInt32 value) {
+	if (value == 0) {
+		epicsTimeGetCurrent(&doneTime);
+		epicsEventSignal(doneEvent);
+	}
+}
+
+/* Get told when the driver has finished with an acquisition */
+static int watchAcq() {
+	asynUser *pasynUser = pasynManager->createAsynUser(0, 0);
+	asynInterface *pif;
+	void *interruptPvt;
+	if (pasynManager->connectDevice(pasynUser, DRVPORT, 0) != asynSuccess) return 0;
+	pif = pasynManager->findInterface(pasynUser, asynDrvUserType, 1);
+	if (pif == NULL || ((asynDrvUser *) pif->pinterface)->create(pif->drvPvt, pasynUser,
+			"ARRAY_ACQ", NULL, NULL) != asynSuccess) return 0;
+	pif = pasynManager->findInterface(pasynUser, asynInt32Type, 1);
+	if (pif == NULL) return 0;
+	return ((asynInt32 *) pif->pinterface)->registerInterruptUser(pif->drvPvt, pasynUser,
+			acqCallback, NULL, &interruptPvt) == asynSuccess;
+}
+
+/* Write value to the driver param called drvInfo */
+static int writeParam(const char *drvInfo, int value) {
+	asynUser *pasynUser;
+	if (pasynInt32SyncIO->connect(DRVPORT, 0, &pasynUser, drvInfo) != asynSuccess) return 0;
+	asynStatus status = pasynInt32SyncIO->write(pasynUser, value, 5.0);
+	pasynInt32SyncIO->disconnect(pasynUser);
+	return status == asynSuccess;
+}
+
+static int readParam(const char *drvInfo) {
+	asynUser *pasynUser;
+	epicsInt32 value = -1;
+	if (pasynInt32SyncIO->connect(DRVPORT, 0, &pasynUser, drvInfo) != asynSuccess) return -1;
+	pasynInt32SyncIO->read(pasynUser, &value, 5.0);
+	pasynInt32SyncIO->disconnect(pasynUser);
+	return value;
+}
+
+/* Make n frames for mask, a time and one field for each bit set */
+static char *makeFrames(unsigned int mask, int n, size_t *len) {
+	int nfields = 0;
+	for (unsigned int m = mask; m; m >>= 1) nfields += m & 1;
+	size_t frameLen = 1 + (nfields + 1) * 8 + 1;
+	char *frames = (char *) malloc(frameLen * n + 1), *p = frames;
+	for (int i = 0; i < n; i++) {
+		p += sprintf(p, "P%08X", i * 10);
+		for (int f = 0; f < nfields; f++) {
+			p += sprintf(p, "%08X", (unsigned int) (i * (f + 1) - 1000 * f));
+		}
+		*p++ = '\n';
+	}
+	*len = p - frames;
+	return frames;
+}
+
+/* Read the frames from a file, keeping only the P... data lines */
+static char *readFrames(const char *fileName, int *n, size_t *len) {
+	char line[NLINE * 2];
+	FILE *fp = fopen(fileName, "r");
+	size_t size = 0, cap = 1 << 20;
+	char *frames = (char *) malloc(cap);
+	*n = 0;
+	if (fp == NULL) {
+		free(frames);
+		return NULL;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		size_t l = strcspn(line, "\r\n");
+		if (l < 2 || line[0] != 'P' || strncmp(line, "PR", l) == 0 || strncmp(line, "PX", l) == 0) continue;
+		if (size + l + 1 > cap) {
+			cap *= 2;
+			frames = (char *) realloc(frames, cap);
+		}
+		memcpy(frames + size, line, l);
+		frames[size + l] = '\n';
+		size += l + 1;
+		(*n)++;
+	}
+	fclose(fp);
+	*len = size;
+	return frames;
+}
+
+static int compareDoubles(const void *a, const void *b) {
+	double d = *(const double *) a - *(const double *) b;
+	return (d > 0) - (d < 0);
+}
+
+/* Replay frames once as one big acquisition for throughput, then burst
+ * frames at a time as acqs acquisitions for latency. Returns 0 if any frames
+ * were dropped or any acquisition didn't finish, as the numbers are wrong */
+static int runMask(unsigned int mask, const char *frames, size_t len, int n, int acqs, int burst) {
+	double elapsed, *lat = (double *) calloc(acqs, sizeof(double));
+	int allocs, dropped, done = 0;
+	size_t burstLen = 0;
+	if (!writeParam("PC_BIT_CAP", mask) || readParam("PC_BIT_CAP") != (int) mask) {
+		printf("0x%03X: can't set PC_BIT_CAP\n", mask);
+		free(lat);
+		return 0;
+	}
+	writeParam("STAT_RESET", 1);
+	// Throughput
+	epicsEventTryWait(doneEvent);
+	allocs = ALLOCS();
+	simArm(frames, len);
+	if (epicsEventWaitWithTimeout(doneEvent, 60.0 + n * 1e-4) != epicsEventWaitOK) {
+		printf("0x%03X: timed out\n", mask);
+		free(lat);
+		return 0;
+	}
+	elapsed = epicsTimeDiffInSeconds(&doneTime, &sim.prTime);
+	allocs = ALLOCS() - allocs;
+	dropped = readParam("STAT_DROPPED");
+	// Latency, from handing out PX to ARRAY_ACQ going to 0. Only the
+	// acquisitions that finished count, a late finish from one that timed
+	// out is thrown away before the next
+	for (int i = 0; i < burst && burstLen < len; burstLen++) {
+		if (frames[burstLen] == '\n') i++;
+	}
+	for (int a = 0; a < acqs; a++) {
+		epicsEventTryWait(doneEvent);
+		simArm(frames, burstLen);
+		if (epicsEventWaitWithTimeout(doneEvent, 10.0) == epicsEventWaitOK) {
+			lat[done++] = epicsTimeDiffInSeconds(&doneTime, &sim.pxTime) * 1e6;
+		}
+	}
+	if (done == 0) {
+		printf("0x%03X: all %d latency acquisitions timed out\n", mask, acqs);
+		free(lat);
+		return 0;
+	}
+	qsort(lat, done, sizeof(double), compareDoubles);
+	printf("0x%03X %8d %10.0f %8.0f %8.3f %7d %8d %8.1f %8.1f %8.1f %8.1f\n", mask, n, n / elapsed,
+			elapsed * 1e9 / n, (double) allocs / n, dropped, acqs - done, lat[done / 2], lat[done * 9 / 10],
+			lat[done * 99 / 100], lat[done - 1]);
+	free(lat);
+	if (dropped != 0) {
+		printf("0x%03X: %d frames dropped, throughput is not for every frame\n", mask, dropped);
+	}
+	if (done < acqs) {
+		printf("0x%03X: %d of %d latency acquisitions timed out\n", mask, acqs - done, acqs);
+	}
+	return dropped == 0 && done == acqs;
+}
+
+int main(int argc, char *argv[]) {
+	unsigned int masks[NMASKS];
+	int nmasks = 0, n = 100000, acqs = 200, burst = 100, nfile = 0, ok = 1, i;
+	const char *fileName = NULL;
+	char *fileFrames = NULL;
+	size_t fileLen = 0;
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+			n = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+			acqs = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+			burst = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc && nmasks < NMASKS) {
+			masks[nmasks++] = strtoul(argv[++i], NULL, 0) & 0x3FF;
+		} else if (argv[i][0] != '-' && fileName == NULL) {
+			fileName = argv[i];
+		} else {
+			fprintf(stderr, "usage: %s [-n frames] [-a acquisitions] [-b burst] [-c mask]... [file]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (fileName != NULL) {
+		if (nmasks != 1) {
+			fprintf(stderr, "Need exactly one -c mask for the frames in %s\n", fileName);
+			return 1;
+		}
+		fileFrames = readFrames(fileName, &nfile, &fileLen);
+		if (fileFrames == NULL || nfile == 0) {
+			fprintf(stderr, "No frames in %s\n", fileName);
+			return 1;
+		}
+		n = nfile;
+	} else if (nmasks == 0) {
+		masks[nmasks++] = 0x1;
+		masks[nmasks++] = 0xF;
+		masks[nmasks++] = 0x3F;
+		masks[nmasks++] = 0x3FF;
+	}
+	if (n < 1 || acqs < 1 || burst < 1) {
+		fprintf(stderr, "-n, -a and -b must be at least 1\n");
+		return 1;
+	}
+	// Make the rings big enough that the throughput run shouldn't drop
+	// frames, runMask fails the run if it does
+	doneEvent = epicsEventMustCreate(epicsEventEmpty);
+	if (!simCreate() || zebraConfig(DRVPORT, SIMPORT, n, n + 16, 0) != asynSuccess
+			|| !watchAcq() || !writeParam("WRITE_WAIT", 1)) {
+		fprintf(stderr, "Can't create the driver\n");
+		return 1;
+	}
+	printf("mask    frames   frames/s ns/frame allocs/f dropped timedout  p50(us)  p90(us)  p99(us)  max(us)\n");
+	for (i = 0; i < nmasks; i++) {
+		if (fileFrames != NULL) {
+			ok = runMask(masks[i], fileFrames, fileLen, n, acqs, burst) && ok;
+		} else {
+			size_t len;
+			char *frames = makeFrames(masks[i], n, &len);
+			ok = runMask(masks[i], frames, len, n, acqs, burst) && ok;
+			free(frames);
+		}
+	}
+	free(fileFrames);
+	epicsExit(ok ? 0 : 1);
+	return ok ? 0 : 1;
+}
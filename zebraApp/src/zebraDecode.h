@@ -0,0 +1,168 @@
+/* Fast decoder for zebra position compare interrupt frames */
+
+#ifndef __ZEBRADECODE_H__
+#define __ZEBRADECODE_H__
+
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* Every field in a position compare frame is 8 upper case hex digits */
+#define ZEBRA_FIELD_LEN 8
+
+/* Returned by zebraDecodeFrame if the frame is not the right length for
+ * the set of channels being captured */
+#define ZEBRA_DECODE_BADLEN -1
+
+/* This is a lookup table of ascii char->hex nibble, 0xFF for not a hex digit */
+static const unsigned char hex_lookup[256] = {
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	   0,    1,    2,    3,    4,    5,    6,    7,    8,    9, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF,   10,   11,   12,   13,   14,   15, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF,   10,   11,   12,   13,   14,   15, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+};
+
+/* Decode a single field of 8 hex digits into value, returning 0 if any of
+ * the characters is not a hex digit */
+static inline int zebraDecodeField(const char *str, unsigned int *value) {
+	const unsigned char *p = (const unsigned char *) str;
+	unsigned int v = 0, bad = 0, n;
+	for (int i = 0; i < ZEBRA_FIELD_LEN; i++) {
+		n = hex_lookup[p[i]];
+		// 0xFF sets bit 4 which no valid nibble has
+		bad |= n;
+		v = (v << 4) | (n & 0xF);
+	}
+	*value = v;
+	return (bad & 0x10) == 0;
+}
+
+#if defined(__SSE2__)
+/* Decode 2 consecutive fields (16 hex digits) at once, returning 0 if any
+ * of the characters is not a hex digit. Reads exactly 16 bytes */
+static inline int zebraDecodeFieldPair(const char *str, unsigned int *values) {
+	const __m128i v = _mm_loadu_si128((const __m128i *) str);
+	// Chars >= 0x80 are negative as signed bytes so fail both range checks
+	const __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+	const __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+			_mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+	const __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+			_mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+	if (_mm_movemask_epi8(_mm_or_si128(digit, alpha)) != 0xFFFF) {
+		return 0;
+	}
+	// '0'..'9' have their value in the low nibble, 'A'..'F' need 9 adding to it
+	const __m128i nibbles = _mm_add_epi8(_mm_and_si128(v, _mm_set1_epi8(0x0F)),
+			_mm_and_si128(alpha, _mm_set1_epi8(9)));
+	// Each 16-bit lane holds (hi nibble, lo nibble) in (low byte, high byte)
+	const __m128i bytes = _mm_or_si128(
+			_mm_slli_epi16(_mm_and_si128(nibbles, _mm_set1_epi16(0x00FF)), 4),
+			_mm_srli_epi16(nibbles, 8));
+	// Pack the 8 bytes down, they are now in big endian order for each field
+	unsigned char packed[16];
+	_mm_storeu_si128((__m128i *) packed, _mm_packus_epi16(bytes, bytes));
+	values[0] = (packed[0] << 24) | (packed[1] << 16) | (packed[2] << 8) | packed[3];
+	values[1] = (packed[4] << 24) | (packed[5] << 16) | (packed[6] << 8) | packed[7];
+	return 1;
+}
+#endif
+
+/* The number of bytes a frame should have for a given capture bitmask */
+static inline int zebraFrameLength(unsigned int cap) {
+	int nfields = 1;
+	for (; cap; cap >>= 1) {
+		nfields += cap & 1;
+	}
+	return 1 + nfields * ZEBRA_FIELD_LEN;
+}
+
+/* Decode a whole position compare frame "P<time><field>..." of len bytes
+ * where there is one field for each bit set in cap. The time goes in
+ * words[0] and the fields in words[1]...
+ * Returns 0 on success, ZEBRA_DECODE_BADLEN if len is wrong for cap, or
+ * the 1-based index of the first field that has a bad hex digit in it
+ * (1 is the time field) */
+static inline int zebraDecodeFrame(const char *frame, int len, unsigned int cap,
+		unsigned int *words) {
+	int nfields, i = 0;
+	if (len != zebraFrameLength(cap) || frame[0] != 'P') {
+		return ZEBRA_DECODE_BADLEN;
+	}
+	nfields = (len - 1) / ZEBRA_FIELD_LEN;
+	frame++;
+#if defined(__SSE2__)
+	for (; i + 1 < nfields; i += 2) {
+		if (!zebraDecodeFieldPair(frame + i * ZEBRA_FIELD_LEN, words + i)) {
+			// find out which of the 2 was bad for the error message
+			return zebraDecodeField(frame + i * ZEBRA_FIELD_LEN, words + i) ? i + 2 : i + 1;
+		}
+	}
+#endif
+	for (; i < nfields; i++) {
+		if (!zebraDecodeField(frame + i * ZEBRA_FIELD_LEN, words + i)) {
+			return i + 1;
+		}
+	}
+	return 0;
+}
+
+/* Binary capture frames are sent instead of "P..." lines by a zebra that
+ * sets ZEBRA_VER_BINARY in SYS_VER, once it has been sent "B". Each one is
+ * a ZEBRA_BINARY_MARK byte, a byte with the number of 32-bit words that
+ * follow, a 16-bit sequence number that goes up by one for every frame,
+ * then the time and a word for each bit set in PC_BIT_CAP, all little
+ * endian. There is no terminator, the length says where the next one
+ * starts */
+#define ZEBRA_VER_BINARY 0x8000
+#define ZEBRA_BINARY_MARK 0xD0
+#define ZEBRA_BINARY_HEADER 4
+
+/* The number of bytes a binary frame should have for a given capture bitmask */
+static inline int zebraBinaryLength(unsigned int cap) {
+	return ZEBRA_BINARY_HEADER + (zebraFrameLength(cap) - 1) / ZEBRA_FIELD_LEN * 4;
+}
+
+/* The sequence number of a binary frame */
+static inline unsigned int zebraBinarySeq(const char *frame) {
+	const unsigned char *p = (const unsigned char *) frame;
+	return p[2] | (p[3] << 8);
+}
+
+/* The number of binary frames lost between one with sequence number last
+ * and the next one to arrive with sequence number seq, allowing for the
+ * sequence number wrapping at 16 bits. last is -1 if there wasn't one */
+static inline int zebraBinaryLost(int last, unsigned int seq) {
+	if (last < 0) return 0;
+	return (seq - (unsigned int) last - 1) & 0xFFFF;
+}
+
+/* Decode a whole binary frame of len bytes like zebraDecodeFrame does.
+ * Returns 0 on success or ZEBRA_DECODE_BADLEN if len is wrong for cap */
+static inline int zebraDecodeBinary(const char *frame, int len, unsigned int cap,
+		unsigned int *words) {
+	const unsigned char *p = (const unsigned char *) frame;
+	int nwords = (len - ZEBRA_BINARY_HEADER) / 4;
+	if (len != zebraBinaryLength(cap) || p[0] != ZEBRA_BINARY_MARK || p[1] != nwords) {
+		return ZEBRA_DECODE_BADLEN;
+	}
+	p += ZEBRA_BINARY_HEADER;
+	for (int i = 0; i < nwords; i++, p += 4) {
+		words[i] = p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int) p[3] << 24);
+	}
+	return 0;
+}
+
+#endif
@@ -0,0 +1,246 @@
+/* zebraDecodeTest.cpp
+ * Unit tests of the position compare frame decoders in zebraDecode.h. The
+ * ascii decoder is checked against the sscanf decode it replaced on made up
+ * frames for every PC_BIT_CAP mask, then on known good and bad frames. The
+ * binary decoder is checked against the ascii one, on bad lengths, and the
+ * lost frame count across the sequence number wrapping.
+ *
+ * usage: make runtests, or run zebraDecodeTest on its own
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <epicsUnitTest.h>
+#include <testMain.h>
+#include "zebraDecode.h"
+
+/* The number of made up frames for each PC_BIT_CAP mask */
+#define NRANDOM 20
+
+/* The max number of words in a frame, the time and 10 channels */
+#define NWORDS 11
+
+/* The characters that aren't hex digits used to spoil frames */
+static const char junk[] = "G/:@`g \x80\xff";
+
+/* Frames are made up from a fixed seed so every run is the same */
+static unsigned int seed = 1;
+static unsigned int nextRandom() {
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+/* The number of words in a frame for cap */
+static int frameWords(unsigned int cap) {
+	return (zebraFrameLength(cap) - 1) / ZEBRA_FIELD_LEN;
+}
+
+/* Make an ascii frame for cap from words in frame, returning its length.
+ * Hex digits are upper case unless mixed is set */
+static int makeFrame(unsigned int cap, const unsigned int *words, int mixed, char *frame) {
+	int len = sprintf(frame, "P");
+	for (int i = 0; i < frameWords(cap); i++) {
+		len += sprintf(frame + len, (mixed && (nextRandom() & 1)) ? "%08x" : "%08X", words[i]);
+	}
+	return len;
+}
+
+/* Make a binary frame for cap from words with sequence number seq in frame,
+ * returning its length */
+static int makeBinary(unsigned int cap, const unsigned int *words, unsigned int seq, char *frame) {
+	unsigned char *p = (unsigned char *) frame;
+	int n = frameWords(cap);
+	p[0] = ZEBRA_BINARY_MARK;
+	p[1] = n;
+	p[2] = seq & 0xFF;
+	p[3] = (seq >> 8) & 0xFF;
+	p += ZEBRA_BINARY_HEADER;
+	for (int i = 0; i < n; i++, p += 4) {
+		p[0] = words[i] & 0xFF;
+		p[1] = (words[i] >> 8) & 0xFF;
+		p[2] = (words[i] >> 16) & 0xFF;
+		p[3] = (words[i] >> 24) & 0xFF;
+	}
+	return ZEBRA_BINARY_HEADER + n * 4;
+}
+
+/* The way frames were decoded before zebraDecode.h, one sscanf per field.
+ * Returns the same as zebraDecodeFrame */
+static int sscanfDecode(const char *frame, unsigned int cap, unsigned int *words) {
+	const char *ptr = frame;
+	int incr, n = 1;
+	if (sscanf(ptr, "P%08X%n", &words[0], &incr) != 1) return 1;
+	ptr += incr;
+	for (int a = 0; a < 10; a++) {
+		if (cap >> a & 1) {
+			if (sscanf(ptr, "%08X%n", &words[n], &incr) != 1) return n + 1;
+			ptr += incr;
+			n++;
+		}
+	}
+	return (ptr[0] != '\0') ? ZEBRA_DECODE_BADLEN : 0;
+}
+
+static void testKnownFrames() {
+	unsigned int words[NWORDS];
+	char frame[128];
+	int ok;
+	testOk(zebraDecodeFrame("P0000000A", 9, 0, words) == 0 && words[0] == 0xA,
+			"time only frame");
+	testOk(zebraDecodeFrame("P12345678FFFFFFFF80000000", 25, 0x3, words) == 0
+			&& words[0] == 0x12345678 && words[1] == 0xFFFFFFFF && words[2] == 0x80000000,
+			"time and 2 encoders");
+	testOk(zebraDecodeFrame("P0000abcd", 9, 0, words) == 0 && words[0] == 0xABCD,
+			"lower case hex digits");
+	strcpy(frame, "P");
+	for (int i = 0; i < NWORDS; i++) {
+		sprintf(frame + 1 + i * ZEBRA_FIELD_LEN, "%08X", 0x01010101 * i);
+	}
+	ok = zebraDecodeFrame(frame, (int) strlen(frame), 0x3FF, words) == 0;
+	for (int i = 0; i < NWORDS; i++) {
+		ok = ok && words[i] == 0x01010101u * i;
+	}
+	testOk(ok, "every channel captured");
+}
+
+static void testAgainstSscanf() {
+	unsigned int words[NWORDS], got[NWORDS], want[NWORDS];
+	char frame[128];
+	int len, rgot, rwant, bad = 0, n = 0;
+	for (unsigned int cap = 0; cap <= 0x3FF; cap++) {
+		for (int r = 0; r < NRANDOM; r++, n++) {
+			for (int i = 0; i < NWORDS; i++) words[i] = nextRandom();
+			len = makeFrame(cap, words, 1, frame);
+			rgot = zebraDecodeFrame(frame, len, cap, got);
+			rwant = sscanfDecode(frame, cap, want);
+			if (rgot != rwant || memcmp(got, want, frameWords(cap) * sizeof(unsigned int)) != 0) {
+				if (bad++ == 0) testDiag("'%s' cap 0x%03X decoded %d, sscanf %d", frame, cap, rgot, rwant);
+			}
+		}
+	}
+	testOk(bad == 0, "%d frames decode the same as sscanf, %d don't", n - bad, bad);
+}
+
+static void testFieldPair() {
+#if defined(__SSE2__)
+	unsigned int words[2], pair[2] = {0, 0}, single[2];
+	char digits[17];
+	int bad = 0;
+	for (int r = 0; r < 10000; r++) {
+		words[0] = nextRandom();
+		words[1] = nextRandom();
+		sprintf(digits, (r & 1) ? "%08x%08X" : "%08X%08x", words[0], words[1]);
+		if (r & 2) {
+			// spoil one of the digits
+			digits[nextRandom() % 16] = junk[nextRandom() % (sizeof(junk) - 1)];
+		}
+		int okPair = zebraDecodeFieldPair(digits, pair);
+		int okSingle = zebraDecodeField(digits, &single[0]) & zebraDecodeField(digits + 8, &single[1]);
+		if (okPair != okSingle || (okPair && (pair[0] != single[0] || pair[1] != single[1]))) {
+			if (bad++ == 0) testDiag("'%s' pair %d single %d", digits, okPair, okSingle);
+		}
+	}
+	testOk(bad == 0, "SSE2 field pairs decode the same as single fields");
+#else
+	testSkip(1, "no SSE2");
+#endif
+}
+
+static void testBadDigits() {
+	unsigned int words[NWORDS];
+	char frame[128];
+	int len, bad = 0;
+	for (int i = 0; i < NWORDS; i++) words[i] = nextRandom();
+	len = makeFrame(0x3FF, words, 0, frame);
+	for (int pos = 1; pos < len; pos++) {
+		for (const char *j = junk; *j; j++) {
+			char save = frame[pos];
+			frame[pos] = *j;
+			if (zebraDecodeFrame(frame, len, 0x3FF, words) != (pos - 1) / ZEBRA_FIELD_LEN + 1) {
+				if (bad++ == 0) testDiag("bad digit at %d not found", pos);
+			}
+			frame[pos] = save;
+		}
+	}
+	testOk(bad == 0, "a bad digit is reported in the field it is in");
+}
+
+static void testBadLength() {
+	unsigned int words[NWORDS];
+	char frame[128];
+	int len;
+	for (int i = 0; i < NWORDS; i++) words[i] = nextRandom();
+	len = makeFrame(0x7, words, 0, frame);
+	testOk(zebraDecodeFrame(frame, len - 1, 0x7, words) == ZEBRA_DECODE_BADLEN,
+			"truncated frame");
+	testOk(zebraDecodeFrame(frame, len, 0x3, words) == ZEBRA_DECODE_BADLEN,
+			"frame with more channels than PC_BIT_CAP");
+	testOk(zebraDecodeFrame("PR", 2, 0, words) == ZEBRA_DECODE_BADLEN,
+			"PR is not a frame");
+	frame[0] = 'X';
+	testOk(zebraDecodeFrame(frame, len, 0x7, words) == ZEBRA_DECODE_BADLEN,
+			"frame without a P");
+}
+
+static void testBinary() {
+	unsigned int words[NWORDS], got[NWORDS], ascii[NWORDS];
+	char frame[128], line[128];
+	int len, bad = 0, badSeq = 0;
+	for (unsigned int cap = 0; cap <= 0x3FF; cap++) {
+		for (int i = 0; i < NWORDS; i++) words[i] = nextRandom();
+		len = makeBinary(cap, words, cap * 61, frame);
+		if (len != zebraBinaryLength(cap) || zebraDecodeBinary(frame, len, cap, got) != 0
+				|| zebraDecodeFrame(line, makeFrame(cap, words, 0, line), cap, ascii) != 0
+				|| memcmp(got, ascii, frameWords(cap) * sizeof(unsigned int)) != 0) {
+			if (bad++ == 0) testDiag("binary frame for cap 0x%03X decoded wrong", cap);
+		}
+		if (zebraBinarySeq(frame) != ((cap * 61) & 0xFFFF)) badSeq++;
+	}
+	testOk(bad == 0, "binary frames decode the same as ascii ones");
+	testOk(badSeq == 0, "binary sequence numbers");
+}
+
+static void testBinaryBadLength() {
+	unsigned int words[NWORDS];
+	char frame[128];
+	int len;
+	for (int i = 0; i < NWORDS; i++) words[i] = nextRandom();
+	len = makeBinary(0x7, words, 0, frame);
+	testOk(zebraDecodeBinary(frame, len - 1, 0x7, words) == ZEBRA_DECODE_BADLEN,
+			"truncated binary frame");
+	testOk(zebraDecodeBinary(frame, len - 4, 0x7, words) == ZEBRA_DECODE_BADLEN,
+			"binary frame a word short");
+	testOk(zebraDecodeBinary(frame, len, 0x3, words) == ZEBRA_DECODE_BADLEN,
+			"binary frame with more channels than PC_BIT_CAP");
+	frame[1]++;
+	testOk(zebraDecodeBinary(frame, len, 0x7, words) == ZEBRA_DECODE_BADLEN,
+			"binary frame with the wrong word count");
+	frame[1]--;
+	frame[0] = 'P';
+	testOk(zebraDecodeBinary(frame, len, 0x7, words) == ZEBRA_DECODE_BADLEN,
+			"binary frame without the mark");
+}
+
+static void testSequence() {
+	testOk(zebraBinaryLost(-1, 1234) == 0, "nothing lost before the first frame");
+	testOk(zebraBinaryLost(1233, 1234) == 0, "nothing lost between consecutive frames");
+	testOk(zebraBinaryLost(0xFFFF, 0) == 0, "nothing lost across the wrap");
+	testOk(zebraBinaryLost(0xFFFE, 1) == 2, "frames lost across the wrap");
+	testOk(zebraBinaryLost(0xFFF0, 0x10) == 31, "more frames lost across the wrap");
+}
+
+MAIN(zebraDecodeTest) {
+	testPlan(23);
+	testKnownFrames();
+	testAgainstSscanf();
+	testFieldPair();
+	testBadDigits();
+	testBadLength();
+	testBinary();
+	testBinaryBadLength();
+	testSequence();
+	return testDone();
+}
@@ -0,0 +1,72 @@
+/* Derived channels worked out from zebra position compare captures
+ *
+ * Each derived channel is an operation on one or two of the captured columns,
+ * worked out for a block of new points at a time in simple loops that the
+ * compiler can vectorise. The operations are:
+ *   DIFF  a[i] - a[i-1], plus wrap if that is negative, for counters that
+ *         roll over like the dividers, which wrap at DIVn_DIV
+ *   VELO  (a[i] - a[i-1]) / (t[i] - t[i-1]), per PC_TIME unit
+ *   SUM   a[i] + b[i]
+ *   RATE  DIFF / (t[i] - t[i-1]), counts per PC_TIME unit
+ * and the result is multiplied by scale. The first point of an acquisition
+ * has no previous point so differences and rates are 0 for it, as are rates
+ * where two points have the same time.
+ */
+
+#ifndef __ZEBRADERIVED_H__
+#define __ZEBRADERIVED_H__
+
+/* The values of PC_DERn_OP */
+#define ZEBRA_DER_OFF 0
+#define ZEBRA_DER_DIFF 1
+#define ZEBRA_DER_VELO 2
+#define ZEBRA_DER_SUM 3
+#define ZEBRA_DER_RATE 4
+#define ZEBRA_DER_NOPS 5
+
+/* The last point of the block before, so differences carry on across blocks */
+struct zebraDeriveState {
+	int have;    // set if there was a block before
+	double a;    // the last a of it
+	double t;    // the last t of it
+};
+
+/* Work out n points of derived channel op into out from n points of its
+ * sources a and b and the times t. b is only used by SUM */
+static inline void zebraDerive(int op, const double *a, const double *b, const double *t,
+		int n, double wrap, double scale, zebraDeriveState *st, double *out) {
+	double dt;
+	if (n <= 0 || op <= ZEBRA_DER_OFF || op >= ZEBRA_DER_NOPS) return;
+	if (op == ZEBRA_DER_SUM) {
+		for (int i = 0; i < n; i++) {
+			out[i] = (a[i] + b[i]) * scale;
+		}
+		return;
+	}
+	// differences, the first from the block before
+	out[0] = st->have ? a[0] - st->a : 0;
+	for (int i = 1; i < n; i++) {
+		out[i] = a[i] - a[i - 1];
+	}
+	if (op != ZEBRA_DER_VELO && wrap > 0) {
+		for (int i = 0; i < n; i++) {
+			out[i] += (out[i] < 0) ? wrap : 0;
+		}
+	}
+	if (op == ZEBRA_DER_VELO || op == ZEBRA_DER_RATE) {
+		dt = st->have ? t[0] - st->t : 0;
+		out[0] = (dt > 0) ? out[0] / dt : 0;
+		for (int i = 1; i < n; i++) {
+			dt = t[i] - t[i - 1];
+			out[i] = (dt > 0) ? out[i] / dt : 0;
+		}
+	}
+	for (int i = 0; i < n; i++) {
+		out[i] *= scale;
+	}
+	st->have = 1;
+	st->a = a[n - 1];
+	st->t = t[n - 1];
+}
+
+#endif
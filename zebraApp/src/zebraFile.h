@@ -0,0 +1,67 @@
+/* Binary columnar file format for zebra position compare captures
+ *
+ * A file holds one acquisition (from PR to PX). All numbers are in the byte
+ * order of the IOC that wrote the file, the byte order field lets a reader
+ * tell which that was.
+ *
+ * Header:
+ *   char        magic[8]     "ZEBRAPC\0"
+ *   epicsUInt32 byteOrder    0x01020304 as written
+ *   epicsUInt32 version      ZEBRA_FILE_VERSION
+ *   epicsUInt32 bitCap       PC_BIT_CAP for this acquisition
+ *   epicsUInt32 ncols        number of columns in each block
+ *   char        names[ncols][ZEBRA_FILE_NAMELEN]
+ *                            null padded column names, PC_TIME first then
+ *                            PC_CAPn for each bit set in bitCap
+ *
+ * Followed by any number of blocks:
+ *   epicsUInt32 npts         number of points in this block
+ *   epicsUInt32 first        index of the first point in the acquisition
+ *   epicsFloat64 data[ncols][npts]
+ *                            one column after another, scaled the same
+ *                            way as the PC_TIME and PC_CAPn waveforms
+ *
+ * The file ends after the last block, so a truncated file still gives every
+ * complete block.
+ */
+
+#ifndef __ZEBRAFILE_H__
+#define __ZEBRAFILE_H__
+
+#include <stdio.h>
+#include <string.h>
+#include <epicsTypes.h>
+
+#define ZEBRA_FILE_VERSION 1
+#define ZEBRA_FILE_NAMELEN 16
+
+/* Write the header of a file holding ncols columns called names, returning 0
+ * if it could not be written */
+static inline int zebraFileWriteHeader(FILE *fp, int bitCap, int ncols, const char **names) {
+	epicsUInt32 fields[4] = { 0x01020304, ZEBRA_FILE_VERSION, (epicsUInt32) bitCap, (epicsUInt32) ncols };
+	char name[ZEBRA_FILE_NAMELEN];
+	if (fwrite("ZEBRAPC", 8, 1, fp) != 1 || fwrite(fields, sizeof(fields), 1, fp) != 1) {
+		return 0;
+	}
+	for (int i = 0; i < ncols; i++) {
+		memset(name, 0, sizeof(name));
+		strncpy(name, names[i], ZEBRA_FILE_NAMELEN - 1);
+		if (fwrite(name, sizeof(name), 1, fp) != 1) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Write a block of npts points starting at point first, data holds ncols
+ * columns of npts values one after another. Returns 0 if it could not be
+ * written */
+static inline int zebraFileWriteBlock(FILE *fp, int first, int npts, int ncols, const epicsFloat64 *data) {
+	epicsUInt32 fields[2] = { (epicsUInt32) npts, (epicsUInt32) first };
+	if (fwrite(fields, sizeof(fields), 1, fp) != 1) {
+		return 0;
+	}
+	return fwrite(data, sizeof(epicsFloat64), (size_t) npts * ncols, fp) == (size_t) npts * ncols;
+}
+
+#endif
@@ -0,0 +1,103 @@
+/* NDArray output of zebra position compare captures for areaDetector plugins
+ *
+ * This is an asynNDArrayDriver port of its own that areaDetector plugins can
+ * have as their NDArrayPort. It has no hardware, the zebra driver hands it
+ * each chunk of new points and it sends them out as a 2D NDFloat64 array of
+ * ncols x npts, so each row is one point: PC_TIME first, then PC_CAPn for
+ * each channel being captured, scaled the same way as the waveforms. Each
+ * array has these attributes:
+ *   ZEBRA_ACQ_NUM       which acquisition since the IOC started
+ *   ZEBRA_FIRST_POINT   index of the first row in the acquisition
+ *   ZEBRA_COLUMNS       comma separated names of the columns
+ *   ZEBRA_START_TIME    PC_TIME of the first row
+ *   ZEBRA_END_TIME      PC_TIME of the last row
+ *   PC_CAPn_SCALE       scale each captured channel was multiplied by
+ *   PC_CAPn_OFF         offset each captured channel had added
+ * and any others from the port's NDAttributesFile.
+ *
+ * Needs ADCore, so it is only built with ZEBRA_NDARRAY defined.
+ */
+
+#ifndef __ZEBRANDARRAY_H__
+#define __ZEBRANDARRAY_H__
+
+#include <string.h>
+#include <epicsStdio.h>
+#include <epicsTime.h>
+#include "asynNDArrayDriver.h"
+
+/* The max length of the ZEBRA_COLUMNS attribute */
+#define ZEBRA_ND_COLUMNS 256
+
+class zebraNDArrays: public asynNDArrayDriver {
+public:
+	zebraNDArrays(const char *portName, size_t maxMemory)
+		: asynNDArrayDriver(portName, 1, 0, maxMemory,
+				asynGenericPointerMask | asynDrvUserMask, asynGenericPointerMask,
+				0, 1, 0, 0) {
+		setIntegerParam(NDArrayCounter, 0);
+		setIntegerParam(NDNDimensions, 2);
+		setIntegerParam(NDDataType, NDFloat64);
+		callParamCallbacks();
+	}
+
+	/* Send n points starting at start of the ncols columns in cols, the
+	 * first of which is the time, as one array. It is point firstPt of
+	 * acquisition acqNum. Returns 0 if there was no memory for the array
+	 * called by the zebra driver with its lock taken */
+	int publish(double **cols, const char **names, const double *scales,
+			const double *offs, int ncols, int start, int n, int firstPt, int acqNum) {
+		size_t dims[2];
+		char columns[ZEBRA_ND_COLUMNS], attr[64];
+		NDArray *pArray;
+		double *p;
+		int counter, len = 0;
+		dims[0] = ncols;
+		dims[1] = n;
+		pArray = this->pNDArrayPool->alloc(2, dims, NDFloat64, 0, NULL);
+		if (pArray == NULL) {
+			return 0;
+		}
+		// Rows are points, so interleave the columns
+		p = (double *) pArray->pData;
+		for (int i = start; i < start + n; i++) {
+			for (int c = 0; c < ncols; c++) {
+				*p++ = cols[c][i];
+			}
+		}
+		columns[0] = '\0';
+		for (int c = 0; c < ncols && len < ZEBRA_ND_COLUMNS; c++) {
+			len += epicsSnprintf(columns + len, ZEBRA_ND_COLUMNS - len, c ? ",%s" : "%s", names[c]);
+		}
+		this->lock();
+		getIntegerParam(NDArrayCounter, &counter);
+		counter++;
+		pArray->uniqueId = counter;
+		epicsTimeGetCurrent(&pArray->epicsTS);
+		pArray->timeStamp = pArray->epicsTS.secPastEpoch + pArray->epicsTS.nsec / 1.e9;
+		this->getAttributes(pArray->pAttributeList);
+		pArray->pAttributeList->add("ZEBRA_ACQ_NUM", "Acquisition number", NDAttrInt32, &acqNum);
+		pArray->pAttributeList->add("ZEBRA_FIRST_POINT", "Index of the first point", NDAttrInt32, &firstPt);
+		pArray->pAttributeList->add("ZEBRA_COLUMNS", "Names of the columns", NDAttrString, columns);
+		pArray->pAttributeList->add("ZEBRA_START_TIME", "PC_TIME of the first point", NDAttrFloat64, &cols[0][start]);
+		pArray->pAttributeList->add("ZEBRA_END_TIME", "PC_TIME of the last point", NDAttrFloat64, &cols[0][start + n - 1]);
+		for (int c = 1; c < ncols; c++) {
+			epicsSnprintf(attr, sizeof(attr), "%s_SCALE", names[c]);
+			pArray->pAttributeList->add(attr, "Scale", NDAttrFloat64, (void *) &scales[c]);
+			epicsSnprintf(attr, sizeof(attr), "%s_OFF", names[c]);
+			pArray->pAttributeList->add(attr, "Offset", NDAttrFloat64, (void *) &offs[c]);
+		}
+		setIntegerParam(NDArrayCounter, counter);
+		setIntegerParam(NDArraySizeX, ncols);
+		setIntegerParam(NDArraySizeY, n);
+		setIntegerParam(NDArraySize, (int) (ncols * n * sizeof(double)));
+		callParamCallbacks();
+		this->unlock();
+		// Plugins that are not blocking callbacks just queue it
+		doCallbacksGenericPointer(pArray, NDArrayData, 0);
+		pArray->release();
+		return 1;
+	}
+};
+
+#endif
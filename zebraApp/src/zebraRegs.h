@@ -17,6 +17,26 @@ struct reg {
     regType type;
 };
 
+/* How a register is polled: static config only changes when we write it,
+ * or on a reset, flash restore or reconnect, volatile status can change at
+ * any time, and commands are never read back */
+enum regClass {
+    regStatic,
+    regVolatile,
+    regCommand
+};
+
+static inline regClass regClassOf(const struct reg *r) {
+    switch (r->type) {
+    case regCmd:
+        return regCommand;
+    case regRO:
+        return regVolatile;
+    default:
+        return regStatic;
+    }
+}
+
 static const struct reg reg_lookup[] = {
     /* Which encoders/divs + system bus to capture in pos comp */
     /* Put this first as it is vital for decoding interrupts */
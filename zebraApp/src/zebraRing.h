@@ -0,0 +1,154 @@
+/* Single producer, single consumer ring of fixed size frame slots for zebra */
+
+#ifndef __ZEBRARING_H__
+#define __ZEBRARING_H__
+
+#include <stdlib.h>
+#include <epicsEvent.h>
+#include <epicsAtomic.h>
+
+/* The ring is shared between exactly one producer (readTask) and one
+ * consumer (interruptTask for interrupts, or whoever holds the driver lock
+ * for command replies). The producer fills a slot in place and commits it,
+ * the consumer reads it in place and releases it. Only the head and tail
+ * indexes are shared, so the data path needs no mutex and no heap traffic.
+ * One slot is always left empty so that head == tail means empty.
+ */
+class zebraRing {
+public:
+	zebraRing(int depth, int slotSize) {
+		this->nslots = depth + 1;
+		this->slotSize = slotSize;
+		this->slots = (char *) calloc(this->nslots, slotSize);
+		this->lens = (int *) calloc(this->nslots, sizeof(int));
+		this->head = 0;
+		this->tail = 0;
+		this->waiting = 0;
+		this->event = epicsEventMustCreate(epicsEventEmpty);
+		this->notify = NULL;
+		this->notifyPvt = NULL;
+	}
+
+	~zebraRing() {
+		epicsEventDestroy(this->event);
+		free(this->lens);
+		free(this->slots);
+	}
+
+	/* Maximum length of a frame that can be put in a slot */
+	int size() {
+		return this->slotSize;
+	}
+
+	/* Number of frames that can be held */
+	int depth() {
+		return this->nslots - 1;
+	}
+
+	/* Number of committed frames waiting for the consumer */
+	int pending() {
+		int n = epicsAtomicGetIntT(&this->head) - epicsAtomicGetIntT(&this->tail);
+		return (n < 0) ? n + this->nslots : n;
+	}
+
+	/* Producer: get the next free slot to fill, or NULL if the ring is full */
+	char *writeSlot() {
+		int h = this->head;
+		if (this->next(h) == epicsAtomicGetIntT(&this->tail)) {
+			return NULL;
+		}
+		return this->slots + h * this->slotSize;
+	}
+
+	/* Producer: publish the slot returned by writeSlot() holding len bytes */
+	void commitSlot(int len) {
+		int h = this->head;
+		this->lens[h] = len;
+		// Make sure the frame is visible before the consumer can see the new head
+		epicsAtomicWriteMemoryBarrier();
+		epicsAtomicSetIntT(&this->head, this->next(h));
+		// Only wake the consumer if it has said it is blocked waiting for us
+		epicsAtomicWriteMemoryBarrier();
+		if (epicsAtomicGetIntT(&this->waiting)) {
+			if (this->notify != NULL) {
+				// Only once for each time the consumer goes idle
+				epicsAtomicSetIntT(&this->waiting, 0);
+				this->notify(this->notifyPvt);
+			} else {
+				epicsEventSignal(this->event);
+			}
+		}
+	}
+
+	/* Consumer: call func(userPvt) from the producer instead of signalling
+	 * the event when a frame arrives for a consumer that has gone idle().
+	 * Must be done before the producer starts */
+	void setNotify(void (*func)(void *), void *userPvt) {
+		this->notifyPvt = userPvt;
+		this->notify = func;
+	}
+
+	/* Consumer: say we are going idle until notified. Returns 1 if the ring
+	 * is still empty so we will be notified, 0 if a frame arrived meanwhile
+	 * and we should carry on */
+	int idle() {
+		epicsAtomicSetIntT(&this->waiting, 1);
+		epicsAtomicWriteMemoryBarrier();
+		// Check again in case the producer committed before it saw the flag
+		if (this->readSlot(NULL) != NULL) {
+			epicsAtomicSetIntT(&this->waiting, 0);
+			return 0;
+		}
+		return 1;
+	}
+
+	/* Consumer: get the oldest committed frame, or NULL if the ring is empty */
+	const char *readSlot(int *len) {
+		int t = this->tail;
+		if (t == epicsAtomicGetIntT(&this->head)) {
+			return NULL;
+		}
+		epicsAtomicReadMemoryBarrier();
+		if (len != NULL) *len = this->lens[t];
+		return this->slots + t * this->slotSize;
+	}
+
+	/* Consumer: as readSlot(), but block for up to timeout seconds for a frame */
+	const char *waitSlot(double timeout, int *len) {
+		const char *frame = this->readSlot(len);
+		if (frame == NULL) {
+			epicsAtomicSetIntT(&this->waiting, 1);
+			epicsAtomicWriteMemoryBarrier();
+			// Check again in case the producer committed before it saw the flag
+			frame = this->readSlot(len);
+			if (frame == NULL) {
+				epicsEventWaitWithTimeout(this->event, timeout);
+				frame = this->readSlot(len);
+			}
+			epicsAtomicSetIntT(&this->waiting, 0);
+		}
+		return frame;
+	}
+
+	/* Consumer: hand the slot returned by readSlot() back to the producer */
+	void releaseSlot() {
+		// Finish reading the frame before the producer can overwrite it
+		epicsAtomicWriteMemoryBarrier();
+		epicsAtomicSetIntT(&this->tail, this->next(this->tail));
+	}
+
+private:
+	int next(int i) {
+		return (i + 1 == this->nslots) ? 0 : i + 1;
+	}
+
+	int nslots, slotSize;
+	char *slots;
+	int *lens;
+	int head, tail, waiting;
+	epicsEventId event;
+	void (*notify)(void *);
+	void *notifyPvt;
+};
+
+#endif
@@ -0,0 +1,143 @@
+/* Shared pool of worker threads for servicing many zebras from one IOC. It
+ * runs the interrupt servicing, file writing and config saving of each zebra,
+ * work that never waits on the serial link. Reading from and writing to each
+ * zebra stays on threads of its own */
+
+#ifndef __ZEBRASCHED_H__
+#define __ZEBRASCHED_H__
+
+#include <epicsStdio.h>
+#include <epicsEvent.h>
+#include <epicsMutex.h>
+#include <epicsThread.h>
+#include <epicsTime.h>
+
+/* The max number of jobs that can be added to a scheduler */
+#define ZEBRA_SCHED_MAXJOBS 256
+
+/* Each job is a function that does a bounded slice of work for one zebra
+ * and returns how many seconds until it next needs to run, 0 if it has more
+ * to do straight away. A job can also be woken early by zebraScheduler::wake
+ * when something arrives for it. A job only ever runs on one worker at a
+ * time, and the worker always picks the job that has been due the longest,
+ * so a busy zebra gets a turn after every other zebra that is waiting, and
+ * can't starve them.
+ */
+typedef double (*zebraSchedFunc)(void *userPvt);
+
+class zebraScheduler {
+public:
+	zebraScheduler(int nworkers) {
+		char name[32];
+		this->njobs = 0;
+		this->lock = epicsMutexMustCreate();
+		this->event = epicsEventMustCreate(epicsEventEmpty);
+		for (int i = 0; i < nworkers; i++) {
+			epicsSnprintf(name, sizeof(name), "ZebraWorker%d", i);
+			epicsThreadCreate(name, epicsThreadPriorityMedium,
+					epicsThreadGetStackSize(epicsThreadStackMedium),
+					(EPICSTHREADFUNC) workerC, this);
+		}
+	}
+
+	/* Add a job that will first run after delay seconds, returning a handle
+	 * to pass to wake(), or -1 if there is no room for it */
+	int add(zebraSchedFunc func, void *userPvt, double delay) {
+		int job = -1;
+		epicsMutexMustLock(this->lock);
+		if (this->njobs < ZEBRA_SCHED_MAXJOBS) {
+			job = this->njobs;
+			this->jobs[job].func = func;
+			this->jobs[job].userPvt = userPvt;
+			this->jobs[job].running = 0;
+			this->jobs[job].woken = 0;
+			epicsTimeGetCurrent(&this->jobs[job].due);
+			epicsTimeAddSeconds(&this->jobs[job].due, delay);
+			this->njobs++;
+		}
+		epicsMutexUnlock(this->lock);
+		epicsEventSignal(this->event);
+		return job;
+	}
+
+	/* Make a job due now. If it is running it will go again as soon as it
+	 * has finished */
+	void wake(int job) {
+		epicsMutexMustLock(this->lock);
+		this->jobs[job].woken = 1;
+		if (!this->jobs[job].running) {
+			epicsTimeGetCurrent(&this->jobs[job].due);
+		}
+		epicsMutexUnlock(this->lock);
+		epicsEventSignal(this->event);
+	}
+
+private:
+	struct schedJob {
+		zebraSchedFunc func;
+		void *userPvt;
+		epicsTimeStamp due;
+		int running, woken;
+	};
+
+	static void workerC(void *userPvt) {
+		((zebraScheduler *) userPvt)->worker();
+	}
+
+	void worker() {
+		epicsTimeStamp now;
+		double wait, late, best, next;
+		int job, ndue;
+		epicsMutexMustLock(this->lock);
+		while (true) {
+			// Find the job that has been due the longest, and how long until
+			// the next one is due if none are
+			epicsTimeGetCurrent(&now);
+			job = -1;
+			ndue = 0;
+			best = 0.0;
+			wait = 1.0;
+			for (int i = 0; i < this->njobs; i++) {
+				if (this->jobs[i].running) continue;
+				late = epicsTimeDiffInSeconds(&now, &this->jobs[i].due);
+				if (late >= 0) {
+					ndue++;
+					if (job < 0 || late > best) {
+						job = i;
+						best = late;
+					}
+				} else if (-late < wait) {
+					wait = -late;
+				}
+			}
+			if (job < 0) {
+				// Nothing due, sleep until the next one is
+				epicsMutexUnlock(this->lock);
+				epicsEventWaitWithTimeout(this->event, wait);
+				epicsMutexMustLock(this->lock);
+				continue;
+			}
+			if (ndue > 1) {
+				// Get another worker onto the rest
+				epicsEventSignal(this->event);
+			}
+			this->jobs[job].running = 1;
+			this->jobs[job].woken = 0;
+			epicsMutexUnlock(this->lock);
+			next = this->jobs[job].func(this->jobs[job].userPvt);
+			epicsMutexMustLock(this->lock);
+			this->jobs[job].running = 0;
+			epicsTimeGetCurrent(&this->jobs[job].due);
+			if (!this->jobs[job].woken && next > 0) {
+				epicsTimeAddSeconds(&this->jobs[job].due, next);
+			}
+		}
+	}
+
+	int njobs;
+	schedJob jobs[ZEBRA_SCHED_MAXJOBS];
+	epicsMutexId lock;
+	epicsEventId event;
+};
+
+#endif
@@ -0,0 +1,565 @@
+/* zebraSim.cpp
+ * A simulated zebra that is an asynOctet port, so it can be used in place of
+ * drvAsynIPPortConfigure or drvAsynSerialPortConfigure in st.cmd. It answers
+ * R, W, S and L commands against a register file made from reg_lookup, and
+ * when PC_ARM is written it sends PR, then a frame for each capture at the
+ * configured rate with a field for each bit in PC_BIT_CAP, then PX when
+ * PC_DISARM is written or PC_PULSE_MAX frames have been sent. Faults can be
+ * injected to load test the driver: junk lines, truncated frames and stalls
+ * where nothing at all comes out of the port. If binary is set it offers
+ * binary frames in SYS_VER, and sends them instead of ascii once it has
+ * been sent "B", until the next SYS_RESET.
+ *
+ * zebraSimConfig(portName, frameRate, latencyMs, binary)
+ * zebraSimFaults(portName, junkFraction, truncFraction, stallEvery, stallFor)
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <epicsTime.h>
+#include <epicsThread.h>
+#include <epicsMutex.h>
+#include <epicsEvent.h>
+#include <epicsStdio.h>
+#include <epicsString.h>
+#include <epicsExport.h>
+#include <iocsh.h>
+#include "asynDriver.h"
+#include "asynOctet.h"
+#include "zebraRegs.h"
+#include "zebraDecode.h"
+
+/* The max number of replies waiting to be read */
+#define NREPLIES 64
+
+/* The size of a reply */
+#define NREPLY 32
+
+/* PC_BIT_CAP has a bit for each of the 10 capture channels */
+#define CAPMASK 0x3FF
+
+/* How long writing to or reading from flash takes */
+#define FLASHTIME 0.1
+
+/* The max number of characters in a junk line */
+#define NJUNK 40
+
+static const char *driverName = "zebraSim";
+
+class zebraSim {
+public:
+	zebraSim(const char *portName, double frameRate, double latencyMs, int binary);
+	int setFaults(double junkFraction, double truncFraction, double stallEvery, double stallFor);
+	void setInputEos(int raw);
+	void report(FILE *fp, int details);
+	asynStatus write(asynUser *pasynUser, const char *data, size_t numchars, size_t *nbytesTransfered);
+	asynStatus read(asynUser *pasynUser, char *data, size_t maxchars, size_t *nbytesTransfered, int *eomReason);
+
+private:
+	int addrOf(const char *name);
+	void queueReply(const char *reply, double delay);
+	void command(const char *cmd);
+	double stalled(const epicsTimeStamp *now);
+	size_t makeFrame(char *data, size_t maxchars, int *binary);
+	unsigned int nextRandom();
+
+	char *portName;
+	epicsMutexId lock;
+	epicsEventId event;
+	epicsTimeStamp startTime, armTime;
+	double frameRate, latency, junkFraction, truncFraction, stallEvery, stallFor;
+	int regs[256], valid[256], flash[256];
+	int armAddr, disarmAddr, capAddr, resetAddr, pulseLoAddr, pulseHiAddr, numLoAddr, numHiAddr, verAddr;
+	char replies[NREPLIES][NREPLY];
+	epicsTimeStamp replyDue[NREPLIES];
+	int replyHead, replyTail;
+	int armed, cap, binaryOffered, binaryOn, rawInput;
+	unsigned int framesSent, frameLimit, frameSeq, seed;
+	asynCommon common;
+	asynOctet octet;
+	asynInterface commonIf, octetIf;
+};
+
+static void reportC(void *drvPvt, FILE *fp, int details) {
+	((zebraSim *) drvPvt)->report(fp, details);
+}
+
+static asynStatus connectC(void *drvPvt, asynUser *pasynUser) {
+	pasynManager->exceptionConnect(pasynUser);
+	return asynSuccess;
+}
+
+static asynStatus disconnectC(void *drvPvt, asynUser *pasynUser) {
+	pasynManager->exceptionDisconnect(pasynUser);
+	return asynSuccess;
+}
+
+static asynStatus writeC(void *drvPvt, asynUser *pasynUser, const char *data,
+		size_t numchars, size_t *nbytesTransfered) {
+	return ((zebraSim *) drvPvt)->write(pasynUser, data, numchars, nbytesTransfered);
+}
+
+static asynStatus readC(void *drvPvt, asynUser *pasynUser, char *data,
+		size_t maxchars, size_t *nbytesTransfered, int *eomReason) {
+	return ((zebraSim *) drvPvt)->read(pasynUser, data, maxchars, nbytesTransfered, eomReason);
+}
+
+static asynStatus flushC(void *drvPvt, asynUser *pasynUser) {
+	return asynSuccess;
+}
+
+/* Zebra terminates lines with \n. With that as the input eos each read
+ * returns a line without it, with no input eos it is left on the end so the
+ * reader can split the lines from the binary frames */
+static asynStatus setInputEosC(void *drvPvt, asynUser *pasynUser, const char *eos, int eoslen) {
+	if (eoslen == 0) {
+		((zebraSim *) drvPvt)->setInputEos(1);
+	} else if (eoslen == 1 && eos[0] == '\n') {
+		((zebraSim *) drvPvt)->setInputEos(0);
+	} else {
+		return asynError;
+	}
+	return asynSuccess;
+}
+
+static asynStatus setOutputEosC(void *drvPvt, asynUser *pasynUser, const char *eos, int eoslen) {
+	return (eoslen == 1 && eos[0] == '\n') ? asynSuccess : asynError;
+}
+
+static asynStatus getEosC(void *drvPvt, asynUser *pasynUser, char *eos, int eossize, int *eoslen) {
+	if (eossize < 1) return asynError;
+	eos[0] = '\n';
+	*eoslen = 1;
+	return asynSuccess;
+}
+
+zebraSim::zebraSim(const char *portName, double frameRate, double latencyMs, int binary) {
+	const char *functionName = "zebraSim";
+	this->portName = epicsStrDup(portName);
+	this->lock = epicsMutexMustCreate();
+	this->event = epicsEventMustCreate(epicsEventEmpty);
+	epicsTimeGetCurrent(&this->startTime);
+	this->armTime = this->startTime;
+	this->frameRate = (frameRate > 0) ? frameRate : 10.0;
+	this->latency = (latencyMs > 0) ? latencyMs / 1000.0 : 0.0;
+	this->setFaults(0, 0, 0, 0);
+	this->replyHead = 0;
+	this->replyTail = 0;
+	this->armed = 0;
+	this->cap = 0;
+	this->framesSent = 0;
+	this->frameLimit = 0;
+	this->frameSeq = 0;
+	this->seed = 0x2545F491;
+	this->binaryOffered = binary;
+	this->binaryOn = 0;
+	this->rawInput = 0;
+
+	/* Only the registers in reg_lookup exist, and they all start at 0 */
+	memset(this->regs, 0, sizeof(this->regs));
+	memset(this->valid, 0, sizeof(this->valid));
+	memset(this->flash, 0, sizeof(this->flash));
+	for (unsigned int i = 0; i < sizeof(reg_lookup) / sizeof(struct reg); i++) {
+		this->valid[reg_lookup[i].addr & 0xFF] = 1;
+	}
+	this->armAddr = this->addrOf("PC_ARM");
+	this->disarmAddr = this->addrOf("PC_DISARM");
+	this->capAddr = this->addrOf("PC_BIT_CAP");
+	this->resetAddr = this->addrOf("SYS_RESET");
+	this->pulseLoAddr = this->addrOf("PC_PULSE_MAXLO");
+	this->pulseHiAddr = this->addrOf("PC_PULSE_MAXHI");
+	this->numLoAddr = this->addrOf("PC_NUM_CAPLO");
+	this->numHiAddr = this->addrOf("PC_NUM_CAPHI");
+	this->verAddr = this->addrOf("SYS_VER");
+	this->regs[this->verAddr] = this->binaryOffered ? ZEBRA_VER_BINARY : 0;
+
+	/* Register as a port that blocks, so asyn gives it a thread like a real
+	 * serial or IP port */
+	this->common.report = reportC;
+	this->common.connect = connectC;
+	this->common.disconnect = disconnectC;
+	memset(&this->octet, 0, sizeof(this->octet));
+	this->octet.write = writeC;
+	this->octet.read = readC;
+	this->octet.flush = flushC;
+	this->octet.setInputEos = setInputEosC;
+	this->octet.getInputEos = getEosC;
+	this->octet.setOutputEos = setOutputEosC;
+	this->octet.getOutputEos = getEosC;
+	this->commonIf.interfaceType = asynCommonType;
+	this->commonIf.pinterface = &this->common;
+	this->commonIf.drvPvt = this;
+	this->octetIf.interfaceType = asynOctetType;
+	this->octetIf.pinterface = &this->octet;
+	this->octetIf.drvPvt = this;
+	if (pasynManager->registerPort(portName, ASYN_CANBLOCK, 1, 0, 0) != asynSuccess
+			|| pasynManager->registerInterface(portName, &this->commonIf) != asynSuccess
+			|| pasynOctetBase->initialize(portName, &this->octetIf, 0, 0, 0) != asynSuccess) {
+		printf("%s:%s: Can't register port %s\n", driverName, functionName, portName);
+	}
+}
+
+/* Return the address of the register called name */
+int zebraSim::addrOf(const char *name) {
+	for (unsigned int i = 0; i < sizeof(reg_lookup) / sizeof(struct reg); i++) {
+		if (strcmp(reg_lookup[i].str, name) == 0) {
+			return reg_lookup[i].addr;
+		}
+	}
+	return -1;
+}
+
+int zebraSim::setFaults(double junkFraction, double truncFraction, double stallEvery, double stallFor) {
+	epicsMutexMustLock(this->lock);
+	this->junkFraction = junkFraction;
+	this->truncFraction = truncFraction;
+	this->stallEvery = stallEvery;
+	this->stallFor = (stallFor < stallEvery) ? stallFor : stallEvery;
+	epicsMutexUnlock(this->lock);
+	return 0;
+}
+
+void zebraSim::setInputEos(int raw) {
+	epicsMutexMustLock(this->lock);
+	this->rawInput = raw;
+	epicsMutexUnlock(this->lock);
+}
+
+void zebraSim::report(FILE *fp, int details) {
+	epicsMutexMustLock(this->lock);
+	fprintf(fp, "zebra simulator %s: %g frames/s, %g ms latency, %s, %u frames sent\n",
+			this->portName, this->frameRate, this->latency * 1000,
+			this->armed ? "armed" : "disarmed", this->framesSent);
+	fprintf(fp, "  %s frames\n", this->binaryOn ? "binary" : "ascii");
+	if (details > 0) {
+		fprintf(fp, "  junk %g, truncated %g, stall for %gs every %gs\n", this->junkFraction,
+				this->truncFraction, this->stallFor, this->stallEvery);
+	}
+	epicsMutexUnlock(this->lock);
+}
+
+/* xorshift32, good enough for deciding when to inject faults */
+unsigned int zebraSim::nextRandom() {
+	this->seed ^= this->seed << 13;
+	this->seed ^= this->seed >> 17;
+	this->seed ^= this->seed << 5;
+	return this->seed;
+}
+
+/* Queue a reply to go out after delay seconds, called with the lock taken */
+void zebraSim::queueReply(const char *reply, double delay) {
+	const char *functionName = "queueReply";
+	int next = (this->replyHead + 1) % NREPLIES;
+	if (next == this->replyTail) {
+		printf("%s:%s: %s: Reply queue full, dropped '%s'\n", driverName, functionName,
+				this->portName, reply);
+		return;
+	}
+	strncpy(this->replies[this->replyHead], reply, NREPLY - 1);
+	this->replies[this->replyHead][NREPLY - 1] = '\0';
+	epicsTimeGetCurrent(&this->replyDue[this->replyHead]);
+	epicsTimeAddSeconds(&this->replyDue[this->replyHead], delay);
+	this->replyHead = next;
+}
+
+/* Act on a command and queue the reply, called with the lock taken */
+void zebraSim::command(const char *cmd) {
+	char reply[NREPLY];
+	unsigned int addr, value;
+	size_t len = strlen(cmd);
+	if (len == 3 && sscanf(cmd, "R%02X", &addr) == 1) {
+		if (!this->valid[addr]) {
+			epicsSnprintf(reply, NREPLY, "E1R%02X", addr);
+		} else {
+			if ((int) addr == this->numLoAddr) {
+				this->regs[addr] = this->framesSent & 0xFFFF;
+			} else if ((int) addr == this->numHiAddr) {
+				this->regs[addr] = this->framesSent >> 16;
+			}
+			epicsSnprintf(reply, NREPLY, "R%02X%04X", addr, this->regs[addr]);
+		}
+		this->queueReply(reply, this->latency);
+	} else if (len == 7 && sscanf(cmd, "W%02X%04X", &addr, &value) == 2) {
+		if (!this->valid[addr]) {
+			epicsSnprintf(reply, NREPLY, "E1W%02X", addr);
+		} else {
+			this->regs[addr] = value;
+			if ((int) addr == this->armAddr) {
+				// Start a new capture, sending PR before the write is acknowledged
+				// and the first frame straight after it
+				epicsTimeGetCurrent(&this->armTime);
+				epicsTimeAddSeconds(&this->armTime, this->latency);
+				this->armed = 1;
+				this->cap = this->regs[this->capAddr] & CAPMASK;
+				this->framesSent = 0;
+				this->frameLimit = (this->regs[this->pulseHiAddr] << 16) | this->regs[this->pulseLoAddr];
+				if (this->frameLimit == 0) this->frameLimit = 0xFFFFFFFF;
+				this->queueReply("PR", this->latency);
+			} else if ((int) addr == this->disarmAddr && this->armed) {
+				// Stop after the frames that are already due, then send PX
+				epicsTimeStamp now;
+				epicsTimeGetCurrent(&now);
+				double due = floor(epicsTimeDiffInSeconds(&now, &this->armTime) * this->frameRate) + 1;
+				if (due < 0) due = 0;
+				if (due < this->frameLimit) this->frameLimit = (unsigned int) due;
+			} else if ((int) addr == this->resetAddr) {
+				memset(this->regs, 0, sizeof(this->regs));
+				this->regs[this->verAddr] = this->binaryOffered ? ZEBRA_VER_BINARY : 0;
+				this->binaryOn = 0;
+			}
+			epicsSnprintf(reply, NREPLY, "W%02XOK", addr);
+		}
+		this->queueReply(reply, this->latency);
+	} else if (strcmp(cmd, "S") == 0) {
+		memcpy(this->flash, this->regs, sizeof(this->regs));
+		this->queueReply("SOK", this->latency + FLASHTIME);
+	} else if (strcmp(cmd, "L") == 0) {
+		memcpy(this->regs, this->flash, sizeof(this->regs));
+		this->regs[this->verAddr] = this->binaryOffered ? ZEBRA_VER_BINARY : 0;
+		this->queueReply("LOK", this->latency + FLASHTIME);
+	} else if (strcmp(cmd, "B") == 0 && this->binaryOffered) {
+		this->binaryOn = 1;
+		this->queueReply("BOK", this->latency);
+	} else {
+		this->queueReply("E0", this->latency);
+	}
+}
+
+/* Each write is one or more commands separated by \n */
+asynStatus zebraSim::write(asynUser *pasynUser, const char *data, size_t numchars,
+		size_t *nbytesTransfered) {
+	char cmd[NREPLY];
+	size_t start = 0, end, len;
+	epicsMutexMustLock(this->lock);
+	while (start < numchars) {
+		for (end = start; end < numchars && data[end] != '\n'; end++);
+		len = end - start;
+		while (len > 0 && data[start + len - 1] == '\r') len--;
+		if (len > 0) {
+			if (len >= NREPLY) len = NREPLY - 1;
+			memcpy(cmd, data + start, len);
+			cmd[len] = '\0';
+			this->command(cmd);
+		}
+		start = end + 1;
+	}
+	epicsMutexUnlock(this->lock);
+	epicsEventSignal(this->event);
+	*nbytesTransfered = numchars;
+	return asynSuccess;
+}
+
+/* If the port is in a stall at now return how long it has left, otherwise
+ * return 0 */
+double zebraSim::stalled(const epicsTimeStamp *now) {
+	if (this->stallEvery <= 0 || this->stallFor <= 0) return 0;
+	double phase = fmod(epicsTimeDiffInSeconds(now, &this->startTime), this->stallEvery);
+	return (phase < this->stallEvery - this->stallFor) ? 0 : this->stallEvery - phase;
+}
+
+/* Write the next frame into data, or a junk line to go before it, and
+ * return its length, setting binary if it is a binary frame
+ * called with the lock taken */
+size_t zebraSim::makeFrame(char *data, size_t maxchars, int *binary) {
+	static const char hex[] = "0123456789ABCDEF";
+	char frame[1 + 11 * 8];
+	unsigned int value, field = 0, nwords = 0;
+	size_t len = 0;
+	*binary = 0;
+	double r = (this->nextRandom() & 0xFFFFFF) / (double) 0x1000000;
+	if (r < this->junkFraction) {
+		// A line of random printable characters, which may start with P
+		len = 1 + this->nextRandom() % NJUNK;
+		for (size_t i = 0; i < len; i++) {
+			frame[i] = (char) (' ' + this->nextRandom() % 95);
+		}
+		if (this->nextRandom() & 1) frame[0] = 'P';
+	} else if (this->binaryOn) {
+		// The same words as below, with a header instead of hex digits.
+		// A truncated frame has a header that says it is short
+		len = ZEBRA_BINARY_HEADER;
+		for (int f = -1; f < 10; f++) {
+			if (f < 0) {
+				value = (unsigned int) fmod(this->framesSent * 1e6 / this->frameRate, 4294967296.0);
+			} else if ((this->cap >> f) & 1) {
+				value = this->framesSent * (++field);
+			} else {
+				continue;
+			}
+			for (int shift = 0; shift < 32; shift += 8) {
+				frame[len++] = (char) ((value >> shift) & 0xFF);
+			}
+			nwords++;
+		}
+		if (r < this->junkFraction + this->truncFraction) {
+			nwords = this->nextRandom() % nwords;
+			len = ZEBRA_BINARY_HEADER + nwords * 4;
+		}
+		frame[0] = (char) ZEBRA_BINARY_MARK;
+		frame[1] = (char) nwords;
+		frame[2] = (char) (this->frameSeq & 0xFF);
+		frame[3] = (char) ((this->frameSeq >> 8) & 0xFF);
+		this->frameSeq++;
+		this->framesSent++;
+		*binary = 1;
+	} else {
+		// The time in us, then a field for each bit in cap. The simulated
+		// encoders just count, so each field is a multiple of the frame number
+		value = (unsigned int) fmod(this->framesSent * 1e6 / this->frameRate, 4294967296.0);
+		frame[len++] = 'P';
+		for (int f = -1; f < 10; f++) {
+			if (f >= 0) {
+				if (!((this->cap >> f) & 1)) continue;
+				value = this->framesSent * (++field);
+			}
+			for (int shift = 28; shift >= 0; shift -= 4) {
+				frame[len++] = hex[(value >> shift) & 0xF];
+			}
+		}
+		if (r < this->junkFraction + this->truncFraction) {
+			len = 1 + this->nextRandom() % (len - 1);
+		}
+		this->framesSent++;
+	}
+	if (len > maxchars) len = maxchars;
+	memcpy(data, frame, len);
+	return len;
+}
+
+/* Hand out the next line that is due, waiting for up to pasynUser->timeout */
+asynStatus zebraSim::read(asynUser *pasynUser, char *data, size_t maxchars,
+		size_t *nbytesTransfered, int *eomReason) {
+	epicsTimeStamp now, deadline;
+	double wait, due, remaining;
+	size_t len = 0;
+	int raw, binary = 0;
+	epicsTimeGetCurrent(&deadline);
+	epicsTimeAddSeconds(&deadline, pasynUser->timeout);
+	*nbytesTransfered = 0;
+	*eomReason = 0;
+	epicsMutexMustLock(this->lock);
+	// A change of eos applies from the next read
+	raw = this->rawInput;
+	while (true) {
+		epicsTimeGetCurrent(&now);
+		wait = this->stalled(&now);
+		if (wait == 0) {
+			wait = pasynUser->timeout;
+			// Replies go before frames
+			if (this->replyTail != this->replyHead) {
+				due = epicsTimeDiffInSeconds(&this->replyDue[this->replyTail], &now);
+				if (due <= 0) {
+					len = strlen(this->replies[this->replyTail]);
+					if (len > maxchars) len = maxchars;
+					memcpy(data, this->replies[this->replyTail], len);
+					this->replyTail = (this->replyTail + 1) % NREPLIES;
+					break;
+				}
+				wait = due;
+			}
+			if (this->armed && this->framesSent >= this->frameLimit) {
+				this->armed = 0;
+				len = (maxchars < 2) ? maxchars : 2;
+				memcpy(data, "PX", len);
+				break;
+			}
+			if (this->armed) {
+				due = (this->framesSent / this->frameRate)
+						- epicsTimeDiffInSeconds(&now, &this->armTime);
+				if (due <= 0) {
+					len = this->makeFrame(data, maxchars, &binary);
+					break;
+				}
+				if (due < wait) wait = due;
+			}
+		}
+		remaining = epicsTimeDiffInSeconds(&deadline, &now);
+		if (remaining <= 0) {
+			epicsMutexUnlock(this->lock);
+			return asynTimeout;
+		}
+		epicsMutexUnlock(this->lock);
+		epicsEventWaitWithTimeout(this->event, (wait < remaining) ? wait : remaining);
+		epicsMutexMustLock(this->lock);
+	}
+	epicsMutexUnlock(this->lock);
+	if (!raw) {
+		*eomReason = ASYN_EOM_EOS;
+	} else if (!binary && len < maxchars) {
+		data[len++] = '\n';
+	}
+	*nbytesTransfered = len;
+	return asynSuccess;
+}
+
+/* Find the simulator that is port portName */
+static zebraSim *findSim(const char *portName) {
+	asynUser *pasynUser = pasynManager->createAsynUser(0, 0);
+	asynInterface *pasynInterface;
+	zebraSim *sim = NULL;
+	if (pasynManager->connectDevice(pasynUser, portName, 0) == asynSuccess) {
+		pasynInterface = pasynManager->findInterface(pasynUser, asynCommonType, 0);
+		if (pasynInterface && ((asynCommon *) pasynInterface->pinterface)->report == reportC) {
+			sim = (zebraSim *) pasynInterface->drvPvt;
+		}
+		pasynManager->disconnect(pasynUser);
+	}
+	pasynManager->freeAsynUser(pasynUser);
+	if (sim == NULL) {
+		printf("%s: %s is not a zebra simulator port\n", driverName, portName);
+	}
+	return sim;
+}
+
+/** Configuration command, called directly or from iocsh */
+extern "C" int zebraSimConfig(const char *portName, double frameRate, double latencyMs, int binary) {
+	new zebraSim(portName, frameRate, latencyMs, binary);
+	return (asynSuccess);
+}
+
+/** Set the faults to inject: the fraction of frames preceded by a junk line,
+ * the fraction truncated, and a stall of stallFor seconds every stallEvery
+ * seconds */
+extern "C" int zebraSimFaults(const char *portName, double junkFraction, double truncFraction,
+		double stallEvery, double stallFor) {
+	zebraSim *sim = findSim(portName);
+	if (sim == NULL) return (asynError);
+	sim->setFaults(junkFraction, truncFraction, stallEvery, stallFor);
+	return (asynSuccess);
+}
+
+/** Code for iocsh registration */
+static const iocshArg zebraSimConfigArg0 = { "Port name", iocshArgString };
+static const iocshArg zebraSimConfigArg1 = { "Frames per second while armed", iocshArgDouble };
+static const iocshArg zebraSimConfigArg2 = { "Command latency in ms", iocshArgDouble };
+static const iocshArg zebraSimConfigArg3 = { "Offer binary frames (0=ascii only)", iocshArgInt };
+static const iocshArg* const zebraSimConfigArgs[] = { &zebraSimConfigArg0,
+		&zebraSimConfigArg1, &zebraSimConfigArg2, &zebraSimConfigArg3 };
+static const iocshFuncDef configzebraSim = { "zebraSimConfig", 4, zebraSimConfigArgs };
+static void configzebraSimCallFunc(const iocshArgBuf *args) {
+	zebraSimConfig(args[0].sval, args[1].dval, args[2].dval, args[3].ival);
+}
+
+static const iocshArg zebraSimFaultsArg0 = { "Port name", iocshArgString };
+static const iocshArg zebraSimFaultsArg1 = { "Fraction of frames preceded by a junk line", iocshArgDouble };
+static const iocshArg zebraSimFaultsArg2 = { "Fraction of frames truncated", iocshArgDouble };
+static const iocshArg zebraSimFaultsArg3 = { "Stall every this many seconds (0=never)", iocshArgDouble };
+static const iocshArg zebraSimFaultsArg4 = { "Stall for this many seconds", iocshArgDouble };
+static const iocshArg* const zebraSimFaultsArgs[] = { &zebraSimFaultsArg0,
+		&zebraSimFaultsArg1, &zebraSimFaultsArg2, &zebraSimFaultsArg3, &zebraSimFaultsArg4 };
+static const iocshFuncDef faultszebraSim = { "zebraSimFaults", 5, zebraSimFaultsArgs };
+static void faultszebraSimCallFunc(const iocshArgBuf *args) {
+	zebraSimFaults(args[0].sval, args[1].dval, args[2].dval, args[3].dval, args[4].dval);
+}
+
+static void zebraSimRegister(void) {
+	iocshRegister(&configzebraSim, configzebraSimCallFunc);
+	iocshRegister(&faultszebraSim, faultszebraSimCallFunc);
+}
+
+extern "C" {
+epicsExportRegistrar(zebraSimRegister);
+}
@@ -0,0 +1,115 @@
+/* Histograms for measuring how long things take in the zebra driver, and
+ * running statistics of the captured values */
+
+#ifndef __ZEBRASTATS_H__
+#define __ZEBRASTATS_H__
+
+#include <math.h>
+#include <epicsAtomic.h>
+#include <epicsTime.h>
+
+/* The number of bins in each histogram. Bin 0 counts durations under 1us,
+ * bin n counts durations from 2^(n-1) to 2^n us, and the last bin counts
+ * everything from 2^(ZEBRA_HIST_BINS-2) us (about a quarter of a second) up */
+#define ZEBRA_HIST_BINS 20
+
+/* Add a duration in seconds to hist. Safe to call from several threads */
+static inline void zebraHistAdd(int *hist, double seconds) {
+	double us = seconds * 1e6;
+	int bin = 0;
+	while (bin < ZEBRA_HIST_BINS - 1 && us >= 1.0) {
+		us /= 2;
+		bin++;
+	}
+	epicsAtomicIncrIntT(&hist[bin]);
+}
+
+/* Add the time since start to hist */
+static inline void zebraHistAddSince(int *hist, const epicsTimeStamp *start) {
+	epicsTimeStamp now;
+	epicsTimeGetCurrent(&now);
+	zebraHistAdd(hist, epicsTimeDiffInSeconds(&now, start));
+}
+
+/* The count, min, max, mean and variance of a column of values, added a batch
+ * at a time so the loops are simple enough to vectorise. Each batch is merged
+ * in with Chan's formula so the variance stays accurate over long scans */
+struct zebraRunStats {
+	double n, min, max, mean, m2, last;
+
+	void reset() {
+		n = min = max = mean = m2 = last = 0;
+	}
+
+	/* Add the nv values of v */
+	void add(const double *v, int nv) {
+		double sum = 0, lo, hi, bm, bm2 = 0;
+		if (nv <= 0) return;
+		lo = hi = v[0];
+		for (int i = 0; i < nv; i++) {
+			sum += v[i];
+			lo = (v[i] < lo) ? v[i] : lo;
+			hi = (v[i] > hi) ? v[i] : hi;
+		}
+		bm = sum / nv;
+		for (int i = 0; i < nv; i++) {
+			bm2 += (v[i] - bm) * (v[i] - bm);
+		}
+		merge(nv, lo, hi, bm, bm2);
+		last = v[nv - 1];
+	}
+
+	/* Add the intervals between each of the nv values of v and the one
+	 * before it, which for v[0] is *prev if havePrev is set. Sets *prev to
+	 * the last value */
+	void addDiffs(const double *v, int nv, double *prev, int havePrev) {
+		double base, lo, hi, bm, bm2, d;
+		if (nv > 0 && !havePrev) {
+			// the first value only starts the first interval
+			*prev = *v++;
+			nv--;
+		}
+		if (nv <= 0) return;
+		base = *prev;
+		*prev = v[nv - 1];
+		lo = hi = v[0] - base;
+		for (int i = 1; i < nv; i++) {
+			d = v[i] - v[i - 1];
+			lo = (d < lo) ? d : lo;
+			hi = (d > hi) ? d : hi;
+		}
+		// the intervals add up to the span
+		bm = (v[nv - 1] - base) / nv;
+		d = v[0] - base - bm;
+		bm2 = d * d;
+		for (int i = 1; i < nv; i++) {
+			d = v[i] - v[i - 1] - bm;
+			bm2 += d * d;
+		}
+		merge(nv, lo, hi, bm, bm2);
+		last = (nv > 1) ? v[nv - 1] - v[nv - 2] : v[0] - base;
+	}
+
+	/* Merge in a batch of k values with this min, max, mean and sum of
+	 * squared deviations from the mean */
+	void merge(int k, double lo, double hi, double bm, double bm2) {
+		double delta = bm - mean, tot = n + k;
+		if (n == 0) {
+			min = lo;
+			max = hi;
+		} else {
+			min = (lo < min) ? lo : min;
+			max = (hi > max) ? hi : max;
+		}
+		mean += delta * k / tot;
+		m2 += bm2 + delta * delta * n * k / tot;
+		n = tot;
+	}
+
+	/* The sample standard deviation */
+	double std() const {
+		return (n > 1) ? sqrt(m2 / (n - 1)) : 0;
+	}
+};
+
+#endif